@@ -0,0 +1,655 @@
+// blkq.c - Block-layer request queue
+//
+
+#ifdef BLKQ_TRACE
+#define TRACE
+#endif
+
+#ifdef BLKQ_DEBUG
+#define DEBUG
+#endif
+
+#include "blkq.h"
+#include "ioimpl.h"
+#include "heap.h"
+#include "thread.h"
+#include "intr.h"
+#include "error.h"
+#include "console.h"
+#include "assert.h"
+
+#include <stddef.h>
+
+// INTERNAL CONSTANT DEFINITIONS
+//
+
+// Up to BLKQ_QLEN requests can be queued, after which submitters sleep until
+// one is dispatched. A queued request has at most BLKQ_SEG_MAX segments, which
+// are copied into the queue; requests with more bypass it.
+
+#ifndef BLKQ_QLEN
+#define BLKQ_QLEN 32
+#endif
+
+#define BLKQ_SEG_MAX 16
+
+// Up to BLKQ_DEPTH merged requests are outstanding on the device at a time,
+// each made of at most BLKQ_MERGE_SEGS segments and BLKQ_MERGE_MAX bytes.
+// Requests arriving while the device is busy wait in the queue, where later
+// ones can be merged with them.
+
+#ifndef BLKQ_DEPTH
+#define BLKQ_DEPTH 4
+#endif
+
+#define BLKQ_MERGE_SEGS 64
+#define BLKQ_MERGE_MAX (64 * 1024)
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct blkq_entry
+{
+    struct blkq_entry * next; // in pending, free or batch list
+    struct blkq_entry * prev; // in pending list
+    struct ioreq * req;
+    unsigned long seq; // submission order
+    int segcnt;
+    struct ioseg segs[BLKQ_SEG_MAX];
+};
+
+// A merged request outstanding on the device, made of the entries on its
+// _first_ list in position order.
+
+struct blkq_batch
+{
+    struct ioreq req;
+    struct blkq * q;
+    struct blkq_entry * first;
+    int busy;
+    struct ioseg segs[BLKQ_MERGE_SEGS];
+};
+
+// The pending list is kept sorted by position. The queue state is shared with
+// the completion callback, which may run in an ISR, so it is only touched with
+// interrupts disabled.
+
+struct blkq
+{
+    struct io io;
+    struct io * bkgio;
+    int blksz;
+
+    struct blkq_entry * pending;
+    struct blkq_entry * free;
+    unsigned long seq;
+    unsigned long long next_pos; // where the elevator sweep continues
+    int nbusy; // batches outstanding
+    int closing;
+
+    struct condition work;  // signalled when there is something to dispatch
+    struct condition space; // signalled when entries are freed
+
+    struct blkq_entry entries[BLKQ_QLEN];
+    struct blkq_batch batches[BLKQ_DEPTH];
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void blkq_close(struct io * io);
+static int blkq_cntl(struct io * io, int cmd, void * arg);
+
+static long blkq_readat (
+    struct io * io, unsigned long long pos, void * buf, long len);
+static long blkq_writeat (
+    struct io * io, unsigned long long pos, const void * buf, long len);
+
+static int blkq_submit(struct io * io, struct ioreq * req);
+static void blkq_drain(struct blkq * q);
+
+static void blkq_dispatcher(struct blkq * q);
+static struct blkq_batch * blkq_merge(struct blkq * q);
+static int blkq_can_merge(const struct blkq_entry * a,
+    const struct blkq_entry * b);
+static int blkq_conflict(const struct blkq_entry * a,
+    const struct blkq_entry * b);
+static struct blkq_entry * blkq_blocker(struct blkq * q,
+    const struct blkq_entry * e);
+static int blkq_inflight(struct blkq * q, const struct blkq_entry * e);
+static void blkq_batch_done(struct ioreq * req);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+struct io * create_blkq_io(struct io * bkgio)
+{
+    static const struct iointf blkq_iointf =
+    {
+        .close = &blkq_close,
+        .cntl = &blkq_cntl,
+        .readat = &blkq_readat,
+        .writeat = &blkq_writeat,
+        .submit = &blkq_submit
+    };
+
+    struct blkq * q;
+    int tid;
+
+    assert (bkgio != NULL);
+
+    q = kcalloc(1, sizeof(struct blkq));
+    q->bkgio = ioaddref(bkgio);
+    q->blksz = ioblksz(bkgio);
+
+    if (q->blksz <= 0)
+    {
+        q->blksz = 1;
+    }
+
+    for (int i = 0; i < BLKQ_QLEN; i++)
+    {
+        q->entries[i].next = q->free;
+        q->free = &q->entries[i];
+    }
+
+    for (int i = 0; i < BLKQ_DEPTH; i++)
+    {
+        q->batches[i].q = q;
+    }
+
+    condition_init(&q->work, "blkq work");
+    condition_init(&q->space, "blkq space");
+
+    tid = thread_spawn("blkq", (void (*)(void)) &blkq_dispatcher, q);
+
+    if (tid < 0)
+    {
+        ioclose(q->bkgio);
+        kfree(q);
+        return NULL;
+    }
+
+    return ioinit1(&q->io, &blkq_iointf);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Waits for the queue to drain, then tells the dispatcher thread to release
+// the backing endpoint and free the queue.
+
+void blkq_close(struct io * io)
+{
+    struct blkq * const q = (void*)io - offsetof(struct blkq, io);
+    int pie;
+
+    blkq_drain(q);
+
+    pie = disable_interrupts();
+    q->closing = 1;
+    condition_broadcast(&q->work);
+    restore_interrupts(pie);
+}
+
+// Passes ioctls on to the backing endpoint. IOCTL_FLUSH must cover every
+// write submitted before it, and IOCTL_DISCARD and IOCTL_WRZEROES must not be
+// overtaken by a queued write to the same range, so these wait for the queue
+// to drain first.
+
+int blkq_cntl(struct io * io, int cmd, void * arg)
+{
+    struct blkq * const q = (void*)io - offsetof(struct blkq, io);
+
+    switch (cmd)
+    {
+    case IOCTL_FLUSH:
+    case IOCTL_DISCARD:
+    case IOCTL_WRZEROES:
+        blkq_drain(q);
+        break;
+    default:
+        break;
+    }
+
+    return ioctl(q->bkgio, cmd, arg);
+}
+
+long blkq_readat (
+    struct io * io, unsigned long long pos, void * buf, long len)
+{
+    struct ioreq req = { .pos = pos, .buf = buf, .len = len };
+    int result;
+
+    result = iosubmit(io, &req);
+
+    if (result < 0)
+    {
+        return result;
+    }
+
+    return iowait(&req);
+}
+
+long blkq_writeat (
+    struct io * io, unsigned long long pos, const void * buf, long len)
+{
+    struct ioreq req =
+        { .pos = pos, .buf = (void*)buf, .len = len, .write = 1 };
+    int result;
+
+    result = iosubmit(io, &req);
+
+    if (result < 0)
+    {
+        return result;
+    }
+
+    return iowait(&req);
+}
+
+// Checks that _req_ is in whole blocks and adds it to the pending list after
+// any requests at the same position, sleeping while the queue is full. The
+// segment list is copied, so the caller's need not outlive the call.
+
+int blkq_submit(struct io * io, struct ioreq * req)
+{
+    struct blkq * const q = (void*)io - offsetof(struct blkq, io);
+    struct blkq_entry * e;
+    struct blkq_entry * p;
+    int pie;
+
+    if (req->pos % q->blksz != 0 || req->len % q->blksz != 0)
+    {
+        return -EINVAL;
+    }
+
+    for (int i = 0; i < req->segcnt; i++)
+    {
+        if (req->segs[i].len <= 0 || req->segs[i].len % q->blksz != 0)
+        {
+            return -EINVAL;
+        }
+    }
+
+    if (req->len == 0)
+    {
+        iocomplete(req, 0);
+        return 0;
+    }
+
+    if (req->segcnt > BLKQ_SEG_MAX)
+    {
+        return iosubmit(q->bkgio, req);
+    }
+
+    pie = disable_interrupts();
+
+    while (q->free == NULL)
+    {
+        condition_wait(&q->space);
+    }
+
+    e = q->free;
+    q->free = e->next;
+
+    e->req = req;
+    e->seq = q->seq++;
+
+    if (req->segcnt == 0)
+    {
+        e->segs[0].buf = req->buf;
+        e->segs[0].len = req->len;
+        e->segcnt = 1;
+    }
+    else
+    {
+        for (int i = 0; i < req->segcnt; i++)
+        {
+            e->segs[i] = req->segs[i];
+        }
+
+        e->segcnt = req->segcnt;
+    }
+
+    // find the last entry at or before the request's position
+
+    p = NULL;
+
+    if (q->pending != NULL && q->pending->req->pos <= req->pos)
+    {
+        p = q->pending;
+
+        while (p->next != NULL && p->next->req->pos <= req->pos)
+        {
+            p = p->next;
+        }
+    }
+
+    e->prev = p;
+    e->next = (p != NULL) ? p->next : q->pending;
+
+    if (e->next != NULL)
+    {
+        e->next->prev = e;
+    }
+
+    if (p != NULL)
+    {
+        p->next = e;
+    }
+    else
+    {
+        q->pending = e;
+    }
+
+    condition_broadcast(&q->work);
+    restore_interrupts(pie);
+
+    return 0;
+}
+
+// Sleeps until every request submitted so far has completed.
+
+void blkq_drain(struct blkq * q)
+{
+    int pie;
+
+    pie = disable_interrupts();
+
+    while (q->pending != NULL || q->nbusy != 0)
+    {
+        condition_wait(&q->space);
+    }
+
+    restore_interrupts(pie);
+}
+
+// Dispatcher thread. Whenever a batch slot is free and a pending request can
+// go to the device, it merges a run of requests into a batch and submits it to
+// the backing device. Requests that arrive while all slots are busy, or that
+// must wait for an outstanding batch, accumulate in the queue and go out
+// together once it completes.
+
+void blkq_dispatcher(struct blkq * q)
+{
+    struct blkq_batch * b;
+    int result;
+    int pie;
+
+    for (;;)
+    {
+        pie = disable_interrupts();
+        b = NULL;
+
+        while (!q->closing && (q->pending == NULL ||
+            q->nbusy == BLKQ_DEPTH || (b = blkq_merge(q)) == NULL))
+        {
+            condition_wait(&q->work);
+        }
+
+        if (q->closing)
+        {
+            restore_interrupts(pie);
+            break;
+        }
+
+        restore_interrupts(pie);
+
+        result = iosubmit(q->bkgio, &b->req);
+
+        if (result < 0)
+        {
+            iocomplete(&b->req, result);
+        }
+    }
+
+    ioclose(q->bkgio);
+    kfree(q);
+    thread_exit();
+}
+
+// Takes a run of pending entries off the queue and builds a batch from them.
+// The run is chosen by a one-way elevator sweep: it includes the first entry
+// at or after _next_pos_, wrapping around to the lowest position when there is
+// none, and extends in both directions over entries that continue each other.
+// An entry is never dispatched ahead of an overlapping one submitted earlier,
+// nor while an overlapping one is outstanding on the device. Returns NULL,
+// leaving the queue as it was, if every pending entry has to wait for an
+// outstanding batch. Must be called with interrupts disabled and a batch slot
+// free.
+
+struct blkq_batch * blkq_merge(struct blkq * q)
+{
+    struct blkq_entry * start;
+    struct blkq_entry * first;
+    struct blkq_entry * last;
+    struct blkq_entry * p;
+    struct blkq_entry * e;
+    struct blkq_batch * b;
+    int segcnt;
+    int cnt;
+    long len;
+
+    for (b = q->batches; b->busy; b++)
+        continue;
+
+    for (e = q->pending; e != NULL && e->req->pos < q->next_pos; e = e->next)
+        continue;
+
+    if (e == NULL)
+    {
+        e = q->pending;
+    }
+
+    // take the first entry in sweep order that can go now
+
+    start = e;
+
+    for (;;)
+    {
+        first = e;
+
+        while ((p = blkq_blocker(q, first)) != NULL)
+        {
+            first = p;
+        }
+
+        if (!blkq_inflight(q, first))
+        {
+            break;
+        }
+
+        e = (e->next != NULL) ? e->next : q->pending;
+
+        if (e == start)
+        {
+            return NULL;
+        }
+    }
+
+    e = first;
+    first = last = e;
+    segcnt = e->segcnt;
+    len = e->req->len;
+
+    while (first->prev != NULL && blkq_can_merge(first->prev, first) &&
+        segcnt + first->prev->segcnt <= BLKQ_MERGE_SEGS &&
+        len + first->prev->req->len <= BLKQ_MERGE_MAX &&
+        blkq_blocker(q, first->prev) == NULL &&
+        !blkq_inflight(q, first->prev))
+    {
+        first = first->prev;
+        segcnt += first->segcnt;
+        len += first->req->len;
+    }
+
+    while (last->next != NULL && blkq_can_merge(last, last->next) &&
+        segcnt + last->next->segcnt <= BLKQ_MERGE_SEGS &&
+        len + last->next->req->len <= BLKQ_MERGE_MAX &&
+        blkq_blocker(q, last->next) == NULL &&
+        !blkq_inflight(q, last->next))
+    {
+        last = last->next;
+        segcnt += last->segcnt;
+        len += last->req->len;
+    }
+
+    // unlink the run and gather its segments
+
+    if (first->prev != NULL)
+    {
+        first->prev->next = last->next;
+    }
+    else
+    {
+        q->pending = last->next;
+    }
+
+    if (last->next != NULL)
+    {
+        last->next->prev = first->prev;
+    }
+
+    last->next = NULL;
+    segcnt = 0;
+    cnt = 0;
+
+    for (e = first; e != NULL; e = e->next)
+    {
+        for (int i = 0; i < e->segcnt; i++)
+        {
+            b->segs[segcnt++] = e->segs[i];
+        }
+
+        cnt++;
+    }
+
+    b->req.pos = first->req->pos;
+    b->req.buf = NULL;
+    b->req.len = len;
+    b->req.segs = b->segs;
+    b->req.segcnt = segcnt;
+    b->req.write = first->req->write;
+    b->req.callback = &blkq_batch_done;
+    b->req.aux = b;
+    b->first = first;
+    b->busy = 1;
+
+    q->nbusy += 1;
+    q->next_pos = b->req.pos + len;
+
+    trace("%s(pos=%llu, len=%ld, write=%d): merged %d requests",
+        __func__, b->req.pos, len, b->req.write, cnt);
+
+    return b;
+}
+
+// Returns nonzero if entry _b_ starts where _a_ ends and both go the same way.
+
+int blkq_can_merge(const struct blkq_entry * a, const struct blkq_entry * b)
+{
+    return (a->req->write == b->req->write &&
+        a->req->pos + a->req->len == b->req->pos);
+}
+
+// Returns nonzero if the ranges of entries _a_ and _b_ overlap and at least
+// one of the two is a write, so that their order matters.
+
+int blkq_conflict(const struct blkq_entry * a, const struct blkq_entry * b)
+{
+    return ((a->req->write || b->req->write) &&
+        a->req->pos < b->req->pos + b->req->len &&
+        b->req->pos < a->req->pos + a->req->len);
+}
+
+// Returns a pending entry submitted before _e_ that conflicts with it, or NULL
+// if there is none. Such an entry must reach the device first.
+
+struct blkq_entry * blkq_blocker(struct blkq * q, const struct blkq_entry * e)
+{
+    struct blkq_entry * p;
+
+    for (p = q->pending; p != NULL; p = p->next)
+    {
+        if (p->seq < e->seq && blkq_conflict(p, e))
+        {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+// Returns nonzero if _e_ conflicts with an entry of a batch still outstanding
+// on the device. The device may complete requests in any order, so _e_ must
+// wait until that batch is done.
+
+int blkq_inflight(struct blkq * q, const struct blkq_entry * e)
+{
+    struct blkq_entry * p;
+
+    for (int i = 0; i < BLKQ_DEPTH; i++)
+    {
+        if (!q->batches[i].busy)
+        {
+            continue;
+        }
+
+        for (p = q->batches[i].first; p != NULL; p = p->next)
+        {
+            if (blkq_conflict(p, e))
+            {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Completion callback of a batch, possibly called from an ISR. Completes each
+// merged request with its share of the batch's result, returns the entries to
+// the free list and frees the batch slot.
+
+void blkq_batch_done(struct ioreq * req)
+{
+    struct blkq_batch * const b = req->aux;
+    struct blkq * const q = b->q;
+    struct blkq_entry * next;
+    struct blkq_entry * e;
+    long rem = req->result;
+    long result;
+    int pie;
+
+    pie = disable_interrupts();
+
+    for (e = b->first; e != NULL; e = next)
+    {
+        next = e->next;
+
+        if (req->result < 0)
+        {
+            result = req->result;
+        }
+        else
+        {
+            result = (rem < e->req->len) ? rem : e->req->len;
+            rem -= result;
+        }
+
+        iocomplete(e->req, result);
+
+        e->req = NULL;
+        e->next = q->free;
+        q->free = e;
+    }
+
+    b->first = NULL;
+    b->busy = 0;
+    q->nbusy -= 1;
+
+    condition_broadcast(&q->work);
+    condition_broadcast(&q->space);
+    restore_interrupts(pie);
+}
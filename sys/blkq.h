@@ -0,0 +1,22 @@
+// blkq.h - Block-layer request queue
+//
+
+#ifndef _BLKQ_H_
+#define _BLKQ_H_
+
+#include "io.h"
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// The create_blkq_io() function returns an I/O endpoint that queues the
+// requests made to it in front of the block device _bkgio_. A dispatcher
+// thread sorts pending requests by position, merges ones that continue each
+// other in the same direction into a single device request, and passes them
+// to _bkgio_ in batches, so that many small requests from several threads
+// reach the device as fewer, larger ones. Buffers passed to the endpoint must
+// be kernel memory. Returns NULL if the dispatcher could not be started.
+
+extern struct io * create_blkq_io(struct io * bkgio);
+
+#endif // _BLKQ_H_
@@ -17,20 +17,107 @@
 #include "cache.h"
 #include "io.h"
 #include "thread.h"
+#include "timer.h"
+#include "intr.h"
+#include "riscv.h"
+#include "memory.h"
 #include "conf.h"
 
 // INTERNAL CONSTANT DEFINITIONS
 //
 
-#ifndef CACHE_CAPACITY
-#define CACHE_CAPACITY 64
+// Bounds on the number of entries a cache may be created or resized with. The
+// capacity must be a power of two.
+
+#ifndef CACHE_CAPACITY_MIN
+#define CACHE_CAPACITY_MIN 32
+#endif
+
+#ifndef CACHE_CAPACITY_MAX
+#define CACHE_CAPACITY_MAX 8192
 #endif
 
 #define CACHE_BLKSZ 512UL
 
+// Resident blocks are indexed by block id in a hash table with one bucket per
+// entry, which keeps chains short, so a lookup does not grow with the capacity.
+
+#define CACHE_HASH_MULT 2654435761U // Knuth's multiplicative constant
+
+#define CACHE_NIL UINT32_MAX // end of hash chain
+
+// Write-back tuning. The flusher thread wakes every CACHE_FLUSH_INTERVAL_MS and
+// writes blocks that have been dirty for at least CACHE_DIRTY_AGE_MS, or every
+// dirty block once 1/CACHE_DIRTY_RATIO of the entries are dirty.
+
+#ifndef CACHE_FLUSH_INTERVAL_MS
+#define CACHE_FLUSH_INTERVAL_MS 100
+#endif
+
+#ifndef CACHE_DIRTY_AGE_MS
+#define CACHE_DIRTY_AGE_MS 1000
+#endif
+
+#ifndef CACHE_DIRTY_RATIO
+#define CACHE_DIRTY_RATIO 2
+#endif
+
+// Readahead tuning. Up to CACHE_RA_STREAMS interleaved sequential readers are
+// tracked. A stream's window starts at CACHE_RA_MIN blocks, doubles up to
+// CACHE_RA_MAX each time a whole window of prefetched blocks gets used, and is
+// reset when the stream is broken by a random access.
+
+#ifndef CACHE_RA_STREAMS
+#define CACHE_RA_STREAMS 4
+#endif
+
+#ifndef CACHE_RA_MIN
+#define CACHE_RA_MIN 2
+#endif
+
+#ifndef CACHE_RA_MAX
+#define CACHE_RA_MAX 16
+#endif
+
+// Dirty blocks with consecutive ids are written back together, up to
+// CACHE_WB_MAX blocks per device request.
+
+#ifndef CACHE_WB_MAX
+#define CACHE_WB_MAX 16
+#endif
+
+// Readahead and write-back runs go to the device as asynchronous requests, up
+// to CACHE_AIO_MAX at a time. Every request moves data straight between the
+// device and the cache's blocks, as a list of segments.
+
+#ifndef CACHE_AIO_MAX
+#define CACHE_AIO_MAX 4
+#endif
+
+#define CACHE_AIO_BLKS (CACHE_RA_MAX > CACHE_WB_MAX ? CACHE_RA_MAX : CACHE_WB_MAX)
+
+// Replacement policy used by a new cache, CACHE_POLICY_CLOCK or CACHE_POLICY_2Q.
+// Under 2Q a block enters a FIFO cold queue of at most 1/CACHE_2Q_KIN_RATIO of
+// the entries and is only admitted to the CLOCK-managed hot queue if it is
+// missed again while its id is still remembered in the ghost queue, which holds
+// the ids of the last capacity/CACHE_2Q_KOUT_RATIO blocks evicted cold.
+
+#ifndef CACHE_POLICY
+#define CACHE_POLICY CACHE_POLICY_2Q
+#endif
+
+#ifndef CACHE_2Q_KIN_RATIO
+#define CACHE_2Q_KIN_RATIO 4
+#endif
+
+#define CACHE_2Q_KOUT_RATIO 2
+
 #define CACHE_USED  (1 << 0)
 #define CACHE_DIRTY (1 << 1)
 #define CACHE_VALID (1 << 2)
+#define CACHE_RAHEAD (1 << 3) // prefetched and not yet accessed
+#define CACHE_HOT   (1 << 4) // on the hot queue rather than the cold one
+#define CACHE_BUSY  (1 << 5) // being read in, contents not valid yet
 
 // INTERNAL MACRO DEFINITIONS
 //
@@ -38,6 +125,16 @@
 #define CACHE_ISUSED(cache_entry) (((cache_entry).flags & CACHE_USED) != 0)
 #define CACHE_ISDIRTY(cache_entry) (((cache_entry).flags & CACHE_DIRTY) != 0)
 #define CACHE_ISVALID(cache_entry) (((cache_entry).flags & CACHE_VALID) != 0)
+#define CACHE_ISRAHEAD(cache_entry) (((cache_entry).flags & CACHE_RAHEAD) != 0)
+#define CACHE_ISHOT(cache_entry) (((cache_entry).flags & CACHE_HOT) != 0)
+#define CACHE_ISBUSY(cache_entry) (((cache_entry).flags & CACHE_BUSY) != 0)
+
+// A pinned entry cannot be evicted or reused.
+
+#define CACHE_ISPINNED(cache_entry) \
+    ((cache_entry).pincnt != 0 || CACHE_ISBUSY(cache_entry))
+
+#define CACHE_BLOCK(cache, idx) ((cache)->data + (idx) * CACHE_BLKSZ)
 
 // EXTERNAL TYPE DEFINITIONS
 //
@@ -45,53 +142,229 @@
 struct cache_entry
 {
     uint32_t block_id;
+    uint32_t hash_next; // next entry in the same hash bucket
+    uint32_t prev;      // neighbours on the free, cold or hot queue
+    uint32_t next;
+    uint16_t pincnt;    // threads holding the block, plus write-backs
     uint_fast8_t flags;
+    uint64_t dirty_time; // rdtime() when the block was first dirtied
+};
+
+struct cache_queue
+{
+    uint32_t head;  // next to be reclaimed
+    uint32_t tail;
+    uint32_t cnt;
+};
+
+struct cache_stream
+{
+    uint64_t next;      // block id that continues the stream
+    uint32_t window;    // blocks read on the last miss
+    uint32_t hits;      // prefetched blocks used since the last miss
+    uint32_t stamp;     // last use, for recycling the oldest stream
+};
+
+// An asynchronous readahead or write-back request. The entries it covers stay
+// CACHE_BUSY (readahead) or pinned (write-back) until the request is reaped.
+
+struct cache_aio
+{
+    struct ioreq req;
+    uint32_t idxs[CACHE_AIO_BLKS];
+    uint32_t cnt;
+    int busy;           // slot in use
+    int * err;          // where a write-back error is reported, or NULL
 };
 
+// The table lock protects the index: the hash table, the queues, the ghost
+// ring, the streams and every entry's block id, flags and pin count. It is
+// never held across device I/O. An entry being read in is flagged CACHE_BUSY
+// while the lock is dropped, and threads that miss on the same block wait on
+// io_done for that read instead of issuing their own. The lock also protects
+// the asynchronous request slots.
+
 struct cache
 {
-    struct cache_entry table[CACHE_CAPACITY];
-    uint32_t clock_idx;
-    uint32_t last_read_idx;
+    struct io * backend;        // block device
+    struct lock lock;           // table lock
+    struct lock wb_lock;        // serializes write-back passes and resizing
+    struct condition io_done;   // a CACHE_BUSY entry was read in, an entry
+                                // lost its last pin, or an asynchronous
+                                // request completed
+
+    uint32_t capacity;          // number of entries
+    struct cache_entry * table;
+    uint32_t * hash_heads;      // first entry of each bucket
+    char * data;                // capacity blocks
+    unsigned int meta_pages;    // pages backing table, hash and ghost arrays
+    unsigned int data_pages;    // pages backing data
+    struct cache_aio aio[CACHE_AIO_MAX];
+    uint32_t * wb_list;         // entries being written back
+
+    uint32_t hash_shift;
+
+    int policy;                 // CACHE_POLICY_CLOCK or CACHE_POLICY_2Q
+    struct cache_queue free;    // entries holding no block
+    struct cache_queue cold;    // 2Q A1in, FIFO
+    struct cache_queue hot;     // 2Q Am, or every entry under CLOCK
+
+    uint32_t ghost_cnt;         // size of the ghost ring, capacity/2
+    uint32_t * ghost_ids;       // 2Q A1out, ids of blocks evicted cold
+    uint32_t * ghost_next;      // next ghost in the same hash bucket
+    uint32_t * ghost_heads;     // first ghost of each bucket
+    uint32_t ghost_idx;         // oldest slot of the ring
+
+    uint64_t end_block; // number of blocks on the backing device
+    struct cache_stream streams[CACHE_RA_STREAMS];
+    uint32_t stream_clock;
+
+    int mode;           // CACHE_WRITETHROUGH or CACHE_WRITEBACK
+    uint32_t ndirty;    // number of dirty entries
+    struct alarm flush_alarm;
+
+    struct cache_stats stats;
 };
 
-// INTERNAL GLOBAL VARIABLES
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int cache_alloc_slots(struct cache * cache, uint32_t capacity);
+static void cache_free_slots(struct cache * cache);
+static int cache_resize(struct cache * cache, uint32_t capacity);
 
-static struct io * backend; // block device
-static char cache_data[CACHE_CAPACITY][CACHE_BLKSZ];
-static struct lock cache_locks[CACHE_CAPACITY];
+static uint32_t cache_hash(const struct cache * cache, uint64_t block_id);
+static uint32_t cache_lookup(const struct cache * cache, uint64_t block_id);
+static void cache_hash_insert(struct cache * cache, uint32_t idx);
+static void cache_hash_remove(struct cache * cache, uint32_t idx);
+
+static struct cache_queue * cache_entry_queue (
+        struct cache * cache, uint32_t idx);
+static void cache_queue_push(
+        struct cache * cache, struct cache_queue * q, uint32_t idx);
+static void cache_queue_remove(
+        struct cache * cache, struct cache_queue * q, uint32_t idx);
+static uint32_t cache_reclaim(
+        struct cache * cache, struct cache_queue * q, int second_chance);
+static void cache_ghost_insert(struct cache * cache, uint32_t block_id);
+static int cache_ghost_remove(struct cache * cache, uint32_t block_id);
+
+static long cache_transfer(struct cache * cache,
+        const struct cache_iov * iov, int iovcnt, int write);
+static int cache_pin_range(struct cache * cache, uint64_t block_id,
+        uint32_t cnt, uint64_t noread_lo, uint64_t noread_hi, uint32_t * idxs);
+static void cache_unpin(struct cache * cache, uint32_t idx, int dirty);
+static void cache_drop_pin(struct cache * cache, uint32_t idx);
+static void cache_discard(struct cache * cache, uint32_t idx);
+
+static void cache_wait_io(struct cache * cache);
+static void cache_mark_dirty(struct cache * cache, uint32_t idx);
+static int cache_clean(struct cache * cache, uint32_t idx);
+static int cache_writeback(struct cache * cache, uint64_t min_age);
+static struct cache_aio * cache_aio_get(struct cache * cache, int wait);
+static void cache_aio_submit(struct cache * cache, struct cache_aio * aio,
+        uint64_t block_id, int write);
+static void cache_aio_done(struct ioreq * req);
+static uint32_t cache_reap(struct cache * cache);
+static int cache_aio_ready(struct cache * cache);
+static void cache_aio_drain(struct cache * cache);
+static int cache_segs(struct cache * cache, const uint32_t * idxs,
+        uint32_t cnt, struct ioseg * segs);
+static uint32_t cache_write_run(struct cache * cache, const uint32_t * idxs,
+        uint32_t cnt, int * err);
+static void cache_sort(struct cache * cache, uint32_t * idxs, uint32_t cnt);
+static void cache_flusher(struct cache * cache);
+
+static struct cache_stream * cache_find_stream (
+        struct cache * cache, uint64_t block_id);
+static uint32_t cache_ra_window(struct cache_stream * stream);
+static uint32_t cache_evict(struct cache * cache);
+static int cache_fill (struct cache * cache, uint64_t block_id,
+        uint32_t cnt, uint32_t npin, int noread);
 
 // EXTERNAL FUNCTION DEFINITIONS
 //
 
-int create_cache(struct io * bkgio, struct cache ** cptr)
+int create_cache (
+        struct io * bkgio, uint32_t capacity, int mode, struct cache ** cptr)
 {
     struct cache * my_cache;
+    unsigned long long end;
+    int result;
+    int tid;
 
-    trace("%s()", __func__);
+    trace("%s(capacity=%d, mode=%d)", __func__, capacity, mode);
+
+    if (mode != CACHE_WRITETHROUGH && mode != CACHE_WRITEBACK)
+    {
+        return -EINVAL;
+    }
 
     my_cache = kcalloc(1, sizeof(struct cache));
-    my_cache->clock_idx = 0;
-    my_cache->last_read_idx = 0;
+    my_cache->mode = mode;
+    my_cache->policy = CACHE_POLICY;
+    my_cache->ndirty = 0;
+    lock_init(&my_cache->lock);
+    lock_init(&my_cache->wb_lock);
+    condition_init(&my_cache->io_done, "cache io");
+
+    result = cache_alloc_slots(my_cache, capacity);
+
+    if (result < 0)
+    {
+        kfree(my_cache);
+        return result;
+    }
+
+    my_cache->backend = ioaddref(bkgio);
+
+    // readahead must not run past the end of the device
+
+    if (ioctl(my_cache->backend, IOCTL_GETEND, &end) == 0)
+    {
+        my_cache->end_block = end / CACHE_BLKSZ;
+    }
+    else
+    {
+        my_cache->end_block = UINT64_MAX;
+    }
 
-    for (int i = 0; i < CACHE_CAPACITY; i++)
+    // dirty blocks of a write-back cache are aged out by a kernel thread
+
+    if (mode == CACHE_WRITEBACK)
     {
-        my_cache->table[i].flags = 0;
-        lock_init(&cache_locks[i]);
+        alarm_init(&my_cache->flush_alarm, "cache flush");
+        tid = thread_spawn("cache flusher",
+            (void (*)(void)) &cache_flusher, my_cache);
+
+        if (tid < 0)
+        {
+            ioclose(my_cache->backend);
+            cache_free_slots(my_cache);
+            kfree(my_cache);
+            return tid;
+        }
     }
 
-    backend = ioaddref(bkgio);
     *cptr = my_cache;
 
     return 0;
 }
 
-// TODO: rewrite for this function to return idx found
+// Returns the index of the entry holding the block at _pos_ and pins it until
+// cache_release_block(). Any number of threads may pin a resident block at the
+// same time. A thread that misses on a block another thread is already reading
+// in waits for that read. A miss that continues a sequential stream also
+// starts reading the stream's readahead window, without waiting for it.
 
-// clock (second chance) algorithm
 int cache_get_block(struct cache * cache, unsigned long long pos, void ** pptr)
 {
+    struct cache_stream * stream;
     uint64_t block_id;
+    uint64_t start;
+    uint32_t cnt;
+    uint32_t idx;
+    int result;
 
     trace("%s(pos=%ld, pptr=%p)", __func__, pos, pptr);
 
@@ -104,55 +377,75 @@ int cache_get_block(struct cache * cache, unsigned long long pos, void ** pptr)
     block_id = pos / CACHE_BLKSZ;
     debug("block=%ld", block_id);
 
-    // check if block is already in cache
-    for (uint32_t i = 0; i < CACHE_CAPACITY; i++)
+    lock_acquire(&cache->lock);
+    stream = cache_find_stream(cache, block_id);
+    cnt = 0;
+
+    for (;;)
     {
-        if (cache->table[i].block_id == block_id && CACHE_ISVALID(cache->table[i]))
+        idx = cache_lookup(cache, block_id);
+
+        if (idx == CACHE_NIL)
         {
-            debug("already in cache");
-            lock_acquire(&cache_locks[i]);
+            // a sequential miss reads the whole window, a random one just the
+            // block
 
-            cache->table[i].flags |= CACHE_USED;
-            cache->last_read_idx = i;
-            *pptr = cache_data[i];
+            if (cnt == 0)
+            {
+                cnt = cache_ra_window(stream);
+            }
 
-            return i;
-        }
-    }
+            start = rdtime();
+            result = cache_fill(cache, block_id, cnt, 1, 0);
 
-    // search for cache entry that has not been (used=0) in a while
-    // if it has been (used=1) give it a "second chance" by making used=0
-    // but moving to the next entry in the table
-    // if the entry gets called again (used=1) it will be saved the next
-    // time cache idx comes around
-    // otherwise the entry will be replaced
-    // iterate through the cache table like a ring
+            if (result == 0)
+            {
+                continue; // another thread started reading the block
+            }
 
-    while (1)
-    {
-        if (!CACHE_ISUSED(cache->table[cache->clock_idx]))
-        {
+            if (result < 0)
+            {
+                lock_release(&cache->lock);
+                return result;
+            }
+
+            idx = cache_lookup(cache, block_id);
+            cache->stats.misses++;
+            cache->stats.miss_ticks += rdtime() - start;
             break;
         }
 
-        cache->table[cache->clock_idx].flags &= ~CACHE_USED;
-        cache->clock_idx = (cache->clock_idx + 1) % CACHE_CAPACITY;
-    }
+        if (!CACHE_ISBUSY(cache->table[idx]))
+        {
+            debug("already in cache");
+            cache->table[idx].pincnt++;
+            cache->stats.hits++;
 
-    uint32_t idx = cache->clock_idx;
+            // first use of a prefetched block: the window was worth reading
 
-    debug("replacing block=%ld in cache", cache->table[idx].block_id);
+            if (CACHE_ISRAHEAD(cache->table[idx]))
+            {
+                cache->table[idx].flags &= ~CACHE_RAHEAD;
+                cache->stats.ra_hits++;
+
+                if (stream != NULL)
+                {
+                    stream->hits++;
+                }
+            }
+
+            break;
+        }
 
-    // put back data stored in old cache idx
-    // then get new block of data and store at old cache idx
+        // another thread is reading the block in, so wait and look again
 
-    lock_acquire(&cache_locks[idx]);
-    ioreadat(backend, pos, cache_data[idx], CACHE_BLKSZ);
+        cache->stats.fill_waits++;
+        cache_wait_io(cache);
+    }
 
-    cache->table[idx].block_id = block_id;
-    cache->table[idx].flags = CACHE_USED | CACHE_VALID;
-    cache->last_read_idx = idx;
-    *pptr = cache_data[idx];
+    cache->table[idx].flags |= CACHE_USED;
+    *pptr = CACHE_BLOCK(cache, idx);
+    lock_release(&cache->lock);
 
     return idx;
 }
@@ -160,27 +453,11 @@ int cache_get_block(struct cache * cache, unsigned long long pos, void ** pptr)
 int cache_readat (
         struct cache * cache, unsigned long long pos, void * buf, long bufsz)
 {
-    uint8_t * pblk;
-    uint32_t block_pos;
-    uint32_t block_off;
-    uint32_t idx;
+    struct cache_iov iov = { .pos = pos, .buf = buf, .len = bufsz };
 
     trace("%s(pos=%lld, buf=%p, bufsz=%ld)", __func__, pos, buf, bufsz);
 
-    block_pos = pos / CACHE_BLKSZ * CACHE_BLKSZ;
-    block_off = pos % CACHE_BLKSZ;
-
-    if (bufsz + block_off > CACHE_BLKSZ)
-    {
-        bufsz = CACHE_BLKSZ - block_off;
-    }
-
-    idx = cache_get_block(cache, block_pos, (void **)&pblk);
-    memcpy(buf, pblk + block_off, bufsz);
-    cache_release_block (
-        cache, cache_data[idx], CACHE_ISDIRTY(cache->table[idx]));
-
-    return bufsz;
+    return cache_transfer(cache, &iov, 1, 0);
 }
 
 int cache_writeat (
@@ -189,62 +466,1670 @@ int cache_writeat (
         const void * buf,
         long len)
 {
-    uint8_t * pblk;
-    uint32_t block_pos;
-    uint32_t block_off;
-    uint32_t idx;
+    struct cache_iov iov = { .pos = pos, .buf = (void *)buf, .len = len };
 
     trace("%s(pos=%lld, buf=%p, len=%ld)", __func__, pos, buf, len);
 
-    block_pos = pos / CACHE_BLKSZ * CACHE_BLKSZ;
-    block_off = pos % CACHE_BLKSZ;
+    return cache_transfer(cache, &iov, 1, 1);
+}
 
-    if (len + block_off > CACHE_BLKSZ)
-    {
-        len = CACHE_BLKSZ - block_off;
-    }
+long cache_readv(struct cache * cache, const struct cache_iov * iov, int iovcnt)
+{
+    trace("%s(iovcnt=%d)", __func__, iovcnt);
+
+    return cache_transfer(cache, iov, iovcnt, 0);
+}
 
-    idx = cache_get_block(cache, block_pos, (void **)&pblk);
-    memcpy(pblk + block_off, buf, len);
-    cache->table[idx].flags |= CACHE_DIRTY;
-    cache_release_block(cache, cache_data[idx],
-        CACHE_ISDIRTY(cache->table[idx]));
+long cache_writev(struct cache * cache, const struct cache_iov * iov, int iovcnt)
+{
+    trace("%s(iovcnt=%d)", __func__, iovcnt);
 
-    return len;
+    return cache_transfer(cache, iov, iovcnt, 1);
 }
 
 void cache_release_block(struct cache * cache, void * pblk, int dirty)
 {
     uint32_t idx;
-    uint32_t block_id;
 
     trace("%s(pblk=%p, dirty=%d)", __func__, pblk, dirty);
 
-    idx = ((uint64_t)pblk - (uint64_t)&cache_data) / 512;
-    block_id = cache->table[idx].block_id;
-    debug("release_block: idx=%d, block_id=%d", idx, block_id);
+    idx = ((char *)pblk - cache->data) / CACHE_BLKSZ;
+    debug("release_block: idx=%d, block_id=%d", idx, cache->table[idx].block_id);
+
+    lock_acquire(&cache->lock);
+    cache_unpin(cache, idx, dirty);
+    lock_release(&cache->lock);
+}
+
+// Writes every dirty block back to the device. Blocks are written in block id
+// order with consecutive blocks merged into one request. Then flushes the
+// device's write cache, so that everything written so far is durable when the
+// call returns. Write-backs in between, by the flusher thread or on eviction,
+// do not wait for the device's cache.
+
+int cache_flush(struct cache * cache)
+{
+    int result;
+    int flush_result;
+
+    trace("%s()", __func__);
+
+    lock_acquire(&cache->wb_lock);
+    result = cache_writeback(cache, 0);
+    flush_result = ioctl(cache->backend, IOCTL_FLUSH, NULL);
+    lock_release(&cache->wb_lock);
+
+    // a backend that does not support IOCTL_FLUSH has no cache to flush
+
+    if (result == 0 && flush_result < 0 && flush_result != -ENOTSUP)
+    {
+        result = flush_result;
+    }
+
+    return result;
+}
+
+int cache_invalidate (
+        struct cache * cache, unsigned long long pos, unsigned long long len)
+{
+    uint64_t block_id;
+    uint64_t end;
+    uint32_t idx;
+
+    trace("%s(pos=%lld, len=%lld)", __func__, pos, len);
 
-    if(dirty)
+    if (pos % CACHE_BLKSZ != 0 || len % CACHE_BLKSZ != 0)
     {
-        iowriteat(backend, block_id * CACHE_BLKSZ, pblk, CACHE_BLKSZ);
-        cache->table[idx].flags &= ~CACHE_DIRTY;
+        return -EINVAL;
     }
 
-    if (cache_locks[idx].owner == current_thread())
+    // holding wb_lock keeps a write-back pass from picking the blocks up
+
+    lock_acquire(&cache->wb_lock);
+    lock_acquire(&cache->lock);
+
+    end = (pos + len) / CACHE_BLKSZ;
+
+    for (block_id = pos / CACHE_BLKSZ; block_id < end; block_id++)
     {
-        lock_release(&cache_locks[idx]);
+        idx = cache_lookup(cache, block_id);
+
+        while (idx != CACHE_NIL && CACHE_ISPINNED(cache->table[idx]))
+        {
+            cache_wait_io(cache);
+            idx = cache_lookup(cache, block_id);
+        }
+
+        if (idx == CACHE_NIL)
+        {
+            continue;
+        }
+
+        if (CACHE_ISDIRTY(cache->table[idx]))
+        {
+            cache->ndirty--;
+        }
+
+        cache_discard(cache, idx);
     }
+
+    lock_release(&cache->lock);
+    lock_release(&cache->wb_lock);
+
+    return 0;
 }
 
-int cache_flush(struct cache * cache)
+int cache_cntl(struct cache * cache, int cmd, void * arg)
 {
-    trace("%s()", __func__);
+    unsigned long long * ullarg = arg;
+    int result;
+
+    trace("%s(cmd=%d)", __func__, cmd);
+
+    switch (cmd)
+    {
+    case IOCTL_GETCACHESZ:
+        *ullarg = cache->capacity;
+        result = 0;
+        break;
+    case IOCTL_SETCACHESZ:
+        if (*ullarg > CACHE_CAPACITY_MAX)
+        {
+            result = -EINVAL;
+            break;
+        }
+
+        result = cache_resize(cache, *ullarg);
+        break;
+    case IOCTL_GETCACHEPOLICY:
+        *ullarg = cache->policy;
+        result = 0;
+        break;
+    case IOCTL_GETCACHESTATS:
+        lock_acquire(&cache->lock);
+        memcpy(arg, &cache->stats, sizeof(struct cache_stats));
+        lock_release(&cache->lock);
+        result = 0;
+        break;
+    case IOCTL_SETCACHEPOLICY:
+        if (*ullarg != CACHE_POLICY_CLOCK && *ullarg != CACHE_POLICY_2Q)
+        {
+            result = -EINVAL;
+            break;
+        }
+
+        // resident entries stay where they are, new ones follow the policy
+
+        lock_acquire(&cache->lock);
+        cache->policy = *ullarg;
+        lock_release(&cache->lock);
+        result = 0;
+        break;
+    default:
+        result = -ENOTSUP;
+    }
+
+    return result;
+}
+
+void cache_dump_stats(struct cache * cache)
+{
+    const struct cache_stats * st = &cache->stats;
+    unsigned long long accesses;
+
+    accesses = st->hits + st->misses;
+
+    kprintf("cache: %u entries, %u dirty, %s, %s\n", cache->capacity,
+        cache->ndirty,
+        (cache->mode == CACHE_WRITEBACK) ? "write-back" : "write-through",
+        (cache->policy == CACHE_POLICY_2Q) ? "2Q" : "clock");
+    kprintf("  hits %llu misses %llu (%llu%% hit), %llu waited on a read\n",
+        st->hits, st->misses,
+        (accesses != 0) ? st->hits * 100 / accesses : 0,
+        st->fill_waits);
+    kprintf("  avg miss latency %llu ticks\n",
+        (st->misses != 0) ? st->miss_ticks / st->misses : 0);
+    kprintf("  readahead %llu blocks, %llu used\n",
+        st->ra_blocks, st->ra_hits);
+    kprintf("  evictions %llu, hot admissions %llu, writebacks %llu\n",
+        st->evictions, st->hot_admits, st->writebacks);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Allocates the entry table, hash buckets, ghost ring and block storage for a
+// cache of _capacity_ entries from physical pages, and resets the cache to
+// empty with every entry on the free queue. Fails without allocating anything
+// if the capacity is out of range or not enough free pages remain.
+
+int cache_alloc_slots(struct cache * cache, uint32_t capacity)
+{
+    unsigned int meta_pages;
+    unsigned int data_pages;
+    size_t meta_size;
+
+    if (capacity < CACHE_CAPACITY_MIN || CACHE_CAPACITY_MAX < capacity ||
+        (capacity & (capacity - 1)) != 0)
+    {
+        return -EINVAL;
+    }
+
+    meta_size = capacity * sizeof(struct cache_entry);
+    meta_size += capacity * sizeof(uint32_t);
+    meta_size += 3 * (capacity / CACHE_2Q_KOUT_RATIO) * sizeof(uint32_t);
+    meta_size += capacity * sizeof(uint32_t);
+    meta_pages = ROUND_UP(meta_size, PAGE_SIZE) / PAGE_SIZE;
+    data_pages = ROUND_UP(capacity * CACHE_BLKSZ, PAGE_SIZE) / PAGE_SIZE;
+
+    if (free_phys_page_count() < meta_pages + data_pages)
+    {
+        return -ENOMEM;
+    }
+
+    cache->table = alloc_phys_pages(meta_pages);
+    cache->hash_heads = (uint32_t *)(cache->table + capacity);
+    cache->ghost_cnt = capacity / CACHE_2Q_KOUT_RATIO;
+    cache->ghost_ids = cache->hash_heads + capacity;
+    cache->ghost_next = cache->ghost_ids + cache->ghost_cnt;
+    cache->ghost_heads = cache->ghost_next + cache->ghost_cnt;
+    cache->wb_list = cache->ghost_heads + cache->ghost_cnt;
+    cache->data = alloc_phys_pages(data_pages);
+    cache->meta_pages = meta_pages;
+    cache->data_pages = data_pages;
+    cache->capacity = capacity;
+    cache->ghost_idx = 0;
+
+    cache->free.head = cache->free.tail = CACHE_NIL;
+    cache->cold.head = cache->cold.tail = CACHE_NIL;
+    cache->hot.head = cache->hot.tail = CACHE_NIL;
+    cache->free.cnt = cache->cold.cnt = cache->hot.cnt = 0;
+
+    // hash_shift keeps the top log2(capacity) bits of the product
+
+    cache->hash_shift = 32;
+
+    for (uint32_t n = 1; n < capacity; n <<= 1)
+    {
+        cache->hash_shift--;
+    }
 
-    for(uint32_t i = 0; i < CACHE_CAPACITY; i++)
+    for (uint32_t i = 0; i < capacity; i++)
     {
-        cache_release_block(
-            cache, cache_data[i], CACHE_ISDIRTY(cache->table[i]));
+        cache->hash_heads[i] = CACHE_NIL;
+        cache->table[i].flags = 0;
+        cache->table[i].pincnt = 0;
+        cache->table[i].hash_next = CACHE_NIL;
+        cache_queue_push(cache, &cache->free, i);
     }
 
+    for (uint32_t i = 0; i < cache->ghost_cnt; i++)
+    {
+        cache->ghost_ids[i] = CACHE_NIL;
+        cache->ghost_heads[i] = CACHE_NIL;
+    }
+
+    return 0;
+}
+
+void cache_free_slots(struct cache * cache)
+{
+    free_phys_pages(cache->table, cache->meta_pages);
+    free_phys_pages(cache->data, cache->data_pages);
+    cache->table = NULL;
+    cache->hash_heads = NULL;
+    cache->data = NULL;
+    cache->capacity = 0;
+}
+
+// Replaces the cache's storage with one of _capacity_ entries. Dirty blocks
+// are written back first and the new cache starts out empty. Fails with
+// -EBUSY if any block is pinned, in which case the cache is left unchanged.
+
+int cache_resize(struct cache * cache, uint32_t capacity)
+{
+    struct cache_entry * table;
+    char * data;
+    unsigned int meta_pages;
+    unsigned int data_pages;
+    int result;
+
+    trace("%s(capacity=%d)", __func__, capacity);
+
+    if (capacity == cache->capacity)
+    {
+        return 0;
+    }
+
+    lock_acquire(&cache->wb_lock);
+    cache_writeback(cache, 0);
+    lock_acquire(&cache->lock);
+
+    // readahead still in flight would land in the old entries
+
+    cache_aio_drain(cache);
+
+    for (uint32_t i = 0; i < cache->capacity; i++)
+    {
+        if (CACHE_ISPINNED(cache->table[i]) || CACHE_ISDIRTY(cache->table[i]))
+        {
+            lock_release(&cache->lock);
+            lock_release(&cache->wb_lock);
+            return -EBUSY;
+        }
+    }
+
+    table = cache->table;
+    data = cache->data;
+    meta_pages = cache->meta_pages;
+    data_pages = cache->data_pages;
+
+    // cache_alloc_slots() fails before touching the cache
+
+    result = cache_alloc_slots(cache, capacity);
+
+    if (result < 0)
+    {
+        lock_release(&cache->lock);
+        lock_release(&cache->wb_lock);
+        return result;
+    }
+
+    free_phys_pages(table, meta_pages);
+    free_phys_pages(data, data_pages);
+
+    // prefetched windows referred to the old entries
+
+    for (int i = 0; i < CACHE_RA_STREAMS; i++)
+    {
+        cache->streams[i].window = 0;
+        cache->streams[i].hits = 0;
+    }
+
+    lock_release(&cache->lock);
+    lock_release(&cache->wb_lock);
+
     return 0;
 }
+
+// Fibonacci hashing: multiply by 2^32/phi and keep the high-order bits, which
+// spreads both sequential and strided block ids evenly over the buckets.
+
+uint32_t cache_hash(const struct cache * cache, uint64_t block_id)
+{
+    return ((uint32_t)block_id * CACHE_HASH_MULT) >> cache->hash_shift;
+}
+
+// Returns the index of the entry holding _block_id_, or CACHE_NIL if the block
+// is not resident. An entry still being read in is returned as well.
+
+uint32_t cache_lookup(const struct cache * cache, uint64_t block_id)
+{
+    uint32_t idx;
+
+    idx = cache->hash_heads[cache_hash(cache, block_id)];
+
+    while (idx != CACHE_NIL)
+    {
+        if (cache->table[idx].block_id == block_id &&
+            CACHE_ISVALID(cache->table[idx]))
+        {
+            return idx;
+        }
+
+        idx = cache->table[idx].hash_next;
+    }
+
+    return CACHE_NIL;
+}
+
+void cache_hash_insert(struct cache * cache, uint32_t idx)
+{
+    uint32_t bucket;
+
+    bucket = cache_hash(cache, cache->table[idx].block_id);
+    cache->table[idx].hash_next = cache->hash_heads[bucket];
+    cache->hash_heads[bucket] = idx;
+}
+
+void cache_hash_remove(struct cache * cache, uint32_t idx)
+{
+    uint32_t * link;
+
+    link = &cache->hash_heads[cache_hash(cache, cache->table[idx].block_id)];
+
+    while (*link != CACHE_NIL)
+    {
+        if (*link == idx)
+        {
+            *link = cache->table[idx].hash_next;
+            cache->table[idx].hash_next = CACHE_NIL;
+            return;
+        }
+
+        link = &cache->table[*link].hash_next;
+    }
+}
+
+// Returns the queue a resident entry belongs on.
+
+struct cache_queue * cache_entry_queue(struct cache * cache, uint32_t idx)
+{
+    return CACHE_ISHOT(cache->table[idx]) ? &cache->hot : &cache->cold;
+}
+
+// Appends entry _idx_ to the tail of queue _q_.
+
+void cache_queue_push(
+        struct cache * cache, struct cache_queue * q, uint32_t idx)
+{
+    cache->table[idx].prev = q->tail;
+    cache->table[idx].next = CACHE_NIL;
+
+    if (q->tail != CACHE_NIL)
+    {
+        cache->table[q->tail].next = idx;
+    }
+    else
+    {
+        q->head = idx;
+    }
+
+    q->tail = idx;
+    q->cnt++;
+}
+
+void cache_queue_remove(
+        struct cache * cache, struct cache_queue * q, uint32_t idx)
+{
+    struct cache_entry * entry = &cache->table[idx];
+
+    if (entry->prev != CACHE_NIL)
+    {
+        cache->table[entry->prev].next = entry->next;
+    }
+    else
+    {
+        q->head = entry->next;
+    }
+
+    if (entry->next != CACHE_NIL)
+    {
+        cache->table[entry->next].prev = entry->prev;
+    }
+    else
+    {
+        q->tail = entry->prev;
+    }
+
+    entry->prev = CACHE_NIL;
+    entry->next = CACHE_NIL;
+    q->cnt--;
+}
+
+// Takes the first unpinned entry off the head of queue _q_ and returns its
+// index, or CACHE_NIL if there is none. Pinned entries are rotated to the tail.
+// With _second_chance_ the queue is run as a clock: an entry used since it was
+// last looked at has its used bit cleared and is rotated to the tail as well.
+
+uint32_t cache_reclaim(
+        struct cache * cache, struct cache_queue * q, int second_chance)
+{
+    uint32_t idx;
+    uint32_t n;
+    uint32_t cnt;
+
+    cnt = 2 * q->cnt;
+
+    for (n = 0; n < cnt; n++)
+    {
+        idx = q->head;
+        cache_queue_remove(cache, q, idx);
+
+        if (CACHE_ISPINNED(cache->table[idx]))
+        {
+            cache_queue_push(cache, q, idx);
+            continue;
+        }
+
+        if (second_chance && CACHE_ISUSED(cache->table[idx]))
+        {
+            cache->table[idx].flags &= ~CACHE_USED;
+            cache_queue_push(cache, q, idx);
+            continue;
+        }
+
+        return idx;
+    }
+
+    return CACHE_NIL;
+}
+
+// Remembers _block_id_ in the ghost ring, forgetting the oldest ghost.
+
+void cache_ghost_insert(struct cache * cache, uint32_t block_id)
+{
+    uint32_t * link;
+    uint32_t slot;
+    uint32_t shift;
+
+    shift = cache->hash_shift + 1; // ghost_cnt is capacity / 2
+    slot = cache->ghost_idx;
+    cache->ghost_idx = (cache->ghost_idx + 1) & (cache->ghost_cnt - 1);
+
+    if (cache->ghost_ids[slot] != CACHE_NIL)
+    {
+        cache_ghost_remove(cache, cache->ghost_ids[slot]);
+    }
+
+    link = &cache->ghost_heads[(block_id * CACHE_HASH_MULT) >> shift];
+    cache->ghost_ids[slot] = block_id;
+    cache->ghost_next[slot] = *link;
+    *link = slot;
+}
+
+// Forgets _block_id_ if it is in the ghost ring. Returns 1 if it was found and
+// 0 otherwise.
+
+int cache_ghost_remove(struct cache * cache, uint32_t block_id)
+{
+    uint32_t * link;
+    uint32_t shift;
+
+    shift = cache->hash_shift + 1;
+    link = &cache->ghost_heads[(block_id * CACHE_HASH_MULT) >> shift];
+
+    while (*link != CACHE_NIL)
+    {
+        if (cache->ghost_ids[*link] == block_id)
+        {
+            cache->ghost_ids[*link] = CACHE_NIL;
+            *link = cache->ghost_next[*link];
+            return 1;
+        }
+
+        link = &cache->ghost_next[*link];
+    }
+
+    return 0;
+}
+
+// Copies between the caller's buffers and the device ranges described by _iov_
+// (from the device when _write_ is 0, to it otherwise). Each range may start
+// and end anywhere. It is handled CACHE_RA_MAX blocks at a time: the blocks of
+// a chunk are pinned together, with the missing ones read in as few device
+// requests as possible, then copied and released. A write does not read the
+// blocks it overwrites completely. Returns the number of bytes transferred, or
+// an error if nothing was.
+
+long cache_transfer(struct cache * cache,
+        const struct cache_iov * iov, int iovcnt, int write)
+{
+    uint32_t idxs[CACHE_RA_MAX];
+    unsigned long long pos;
+    uint64_t block_id;
+    uint32_t blkoff;
+    uint32_t cnt;
+    uint32_t n;
+    char * buf;
+    long chunk;
+    long len;
+    long rem;
+    long total;
+    int result;
+
+    total = 0;
+
+    for (int k = 0; k < iovcnt; k++)
+    {
+        pos = iov[k].pos;
+        buf = iov[k].buf;
+        len = iov[k].len;
+
+        while (len > 0)
+        {
+            block_id = pos / CACHE_BLKSZ;
+            blkoff = pos % CACHE_BLKSZ;
+            cnt = (blkoff + len + CACHE_BLKSZ - 1) / CACHE_BLKSZ;
+
+            if (cnt > CACHE_RA_MAX)
+            {
+                cnt = CACHE_RA_MAX;
+            }
+
+            chunk = cnt * CACHE_BLKSZ - blkoff;
+
+            if (chunk > len)
+            {
+                chunk = len;
+            }
+
+            // only a write has blocks that need not be read
+
+            if (write)
+            {
+                result = cache_pin_range(cache, block_id, cnt,
+                    (pos + CACHE_BLKSZ - 1) / CACHE_BLKSZ,
+                    (pos + chunk) / CACHE_BLKSZ, idxs);
+            }
+            else
+            {
+                result = cache_pin_range(cache, block_id, cnt, 0, 0, idxs);
+            }
+
+            if (result < 0)
+            {
+                return (total != 0) ? total : result;
+            }
+
+            rem = chunk;
+
+            for (uint32_t i = 0; i < cnt; i++)
+            {
+                n = CACHE_BLKSZ - blkoff;
+
+                if (n > rem)
+                {
+                    n = rem;
+                }
+
+                if (write)
+                {
+                    memcpy(CACHE_BLOCK(cache, idxs[i]) + blkoff, buf, n);
+                }
+                else
+                {
+                    memcpy(buf, CACHE_BLOCK(cache, idxs[i]) + blkoff, n);
+                }
+
+                buf += n;
+                rem -= n;
+                blkoff = 0;
+            }
+
+            lock_acquire(&cache->lock);
+
+            for (uint32_t i = 0; i < cnt; i++)
+            {
+                cache_unpin(cache, idxs[i], write);
+            }
+
+            lock_release(&cache->lock);
+
+            pos += chunk;
+            len -= chunk;
+            total += chunk;
+        }
+    }
+
+    return total;
+}
+
+// Pins the _cnt_ consecutive blocks starting at _block_id_ for the caller and
+// stores their entry indices in _idxs_. Each run of missing blocks is read with
+// one device request; the last one is extended by the readahead window if the
+// range continues a sequential stream. Missing blocks in [_noread_lo_,
+// _noread_hi_) are not read at all. They are left flagged CACHE_BUSY, so that
+// nobody else sees their stale contents, until the caller has filled them in
+// and unpins them. On error, nothing is left pinned.
+
+int cache_pin_range(struct cache * cache, uint64_t block_id,
+        uint32_t cnt, uint64_t noread_lo, uint64_t noread_hi, uint32_t * idxs)
+{
+    struct cache_stream * stream;
+    uint64_t start;
+    uint32_t extra;
+    uint32_t idx;
+    uint32_t i;
+    uint32_t j;
+    uint32_t n;
+    int noread;
+    int result;
+
+    lock_acquire(&cache->lock);
+
+    stream = cache_find_stream(cache, block_id);
+
+    if (stream != NULL)
+    {
+        stream->next = block_id + cnt;
+    }
+
+    i = 0;
+
+    while (i < cnt)
+    {
+        idx = cache_lookup(cache, block_id + i);
+
+        if (idx != CACHE_NIL && CACHE_ISBUSY(cache->table[idx]))
+        {
+            cache->stats.fill_waits++;
+            cache_wait_io(cache);
+            continue;
+        }
+
+        if (idx != CACHE_NIL)
+        {
+            cache->table[idx].pincnt++;
+            cache->table[idx].flags |= CACHE_USED;
+            cache->stats.hits++;
+
+            if (CACHE_ISRAHEAD(cache->table[idx]))
+            {
+                cache->table[idx].flags &= ~CACHE_RAHEAD;
+                cache->stats.ra_hits++;
+
+                if (stream != NULL)
+                {
+                    stream->hits++;
+                }
+            }
+
+            idxs[i++] = idx;
+            continue;
+        }
+
+        // collect the run of missing blocks that are all read or all not
+
+        noread = (noread_lo <= block_id + i && block_id + i < noread_hi);
+        n = 1;
+
+        while (i + n < cnt &&
+            cache_lookup(cache, block_id + i + n) == CACHE_NIL &&
+            noread == (noread_lo <= block_id + i + n &&
+                block_id + i + n < noread_hi))
+        {
+            n++;
+        }
+
+        extra = 0;
+
+        if (!noread && i + n == cnt && stream != NULL)
+        {
+            extra = cache_ra_window(stream);
+
+            if (n + extra > CACHE_RA_MAX)
+            {
+                extra = CACHE_RA_MAX - n;
+            }
+        }
+
+        start = rdtime();
+        result = cache_fill(cache, block_id + i, n + extra, n, noread);
+
+        if (result == 0)
+        {
+            continue; // another thread started reading the block
+        }
+
+        if (result < 0)
+        {
+            for (j = 0; j < i; j++)
+            {
+                if (CACHE_ISBUSY(cache->table[idxs[j]]))
+                {
+                    cache_discard(cache, idxs[j]); // never filled in
+                }
+                else
+                {
+                    cache_unpin(cache, idxs[j], 0);
+                }
+            }
+
+            lock_release(&cache->lock);
+            return result;
+        }
+
+        // the fill may have stopped short of the run
+
+        for (j = 0; j < n && j < (uint32_t)result; j++)
+        {
+            idx = cache_lookup(cache, block_id + i + j);
+            cache->table[idx].flags |= CACHE_USED;
+            idxs[i + j] = idx;
+        }
+
+        cache->stats.misses += j;
+        cache->stats.miss_ticks += rdtime() - start;
+        i += j;
+    }
+
+    lock_release(&cache->lock);
+
+    return 0;
+}
+
+// Drops one pin on entry _idx_, first marking it dirty if _dirty_ is set. An
+// entry the caller allocated without reading becomes visible to other threads
+// here. Called with the table lock held.
+
+void cache_unpin(struct cache * cache, uint32_t idx, int dirty)
+{
+    if (CACHE_ISBUSY(cache->table[idx]))
+    {
+        cache->table[idx].flags &= ~CACHE_BUSY;
+        condition_broadcast(&cache->io_done);
+    }
+
+    if (dirty)
+    {
+        cache_mark_dirty(cache, idx);
+
+        if (cache->mode == CACHE_WRITETHROUGH)
+        {
+            cache_clean(cache, idx);
+        }
+    }
+
+    if (cache->table[idx].pincnt != 0)
+    {
+        cache_drop_pin(cache, idx);
+    }
+}
+
+// Drops one pin on entry _idx_ and, once none are left, wakes the threads
+// waiting in cache_invalidate() for the entry to become unpinned. Called with
+// the table lock held.
+
+void cache_drop_pin(struct cache * cache, uint32_t idx)
+{
+    if (--cache->table[idx].pincnt == 0)
+    {
+        condition_broadcast(&cache->io_done);
+    }
+}
+
+// Drops the block held by entry _idx_ from the cache and returns the entry to
+// the free queue. Called with the table lock held on an unpinned entry, or on
+// one whose contents never became valid.
+
+void cache_discard(struct cache * cache, uint32_t idx)
+{
+    cache_hash_remove(cache, idx);
+    cache_queue_remove(cache, cache_entry_queue(cache, idx), idx);
+    cache->table[idx].flags = 0;
+    cache->table[idx].pincnt = 0;
+    cache_queue_push(cache, &cache->free, idx);
+    condition_broadcast(&cache->io_done);
+}
+
+// Sleeps until some CACHE_BUSY entry has been read in or an asynchronous
+// request has completed, and reaps completed requests. Returns at once if
+// there were any to reap. The caller holds the table lock once; it is dropped
+// while waiting and held again on return. Interrupts are disabled from the
+// last check to the wait so that a broadcast cannot slip in between.
+
+void cache_wait_io(struct cache * cache)
+{
+    int pie;
+
+    if (cache_reap(cache) != 0)
+    {
+        return;
+    }
+
+    pie = disable_interrupts();
+
+    if (cache_aio_ready(cache))
+    {
+        restore_interrupts(pie);
+    }
+    else
+    {
+        lock_release(&cache->lock);
+        condition_wait(&cache->io_done);
+        restore_interrupts(pie);
+        lock_acquire(&cache->lock);
+    }
+
+    cache_reap(cache);
+}
+
+// Returns nonzero if an asynchronous request has completed but has not been
+// reaped yet.
+
+int cache_aio_ready(struct cache * cache)
+{
+    for (int i = 0; i < CACHE_AIO_MAX; i++)
+    {
+        if (cache->aio[i].busy && iopoll(&cache->aio[i].req))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void cache_mark_dirty(struct cache * cache, uint32_t idx)
+{
+    if (!CACHE_ISDIRTY(cache->table[idx]))
+    {
+        cache->table[idx].flags |= CACHE_DIRTY;
+        cache->table[idx].dirty_time = rdtime();
+        cache->ndirty++;
+    }
+}
+
+// Writes a dirty entry back to the backing device. The caller holds the table
+// lock, which is dropped during the write. The entry is marked clean before
+// the write and stays pinned until it completes, so a thread that modifies
+// the block meanwhile dirties it again rather than losing its change.
+
+int cache_clean(struct cache * cache, uint32_t idx)
+{
+    uint64_t pos;
+    long result;
+
+    pos = cache->table[idx].block_id * CACHE_BLKSZ;
+    debug("writing back block=%d", cache->table[idx].block_id);
+
+    cache->table[idx].pincnt++;
+    cache->table[idx].flags &= ~CACHE_DIRTY;
+    cache->ndirty--;
+    lock_release(&cache->lock);
+
+    result = iowriteat(cache->backend, pos, CACHE_BLOCK(cache, idx), CACHE_BLKSZ);
+
+    lock_acquire(&cache->lock);
+
+    if (result < 0)
+    {
+        cache_mark_dirty(cache, idx);
+    }
+    else
+    {
+        cache->stats.writebacks++;
+    }
+
+    cache_drop_pin(cache, idx);
+
+    return (result < 0) ? result : 0;
+}
+
+// Writes back the entries that have been dirty for at least _min_age_ ticks.
+// The entries are sorted by block id and each run of consecutive blocks goes
+// to the device as a single request. Up to CACHE_AIO_MAX runs are in flight at
+// once, and all of them have completed on return. Returns the first error
+// reported by the device, or 0. The caller must hold wb_lock, which protects
+// wb_list.
+
+int cache_writeback(struct cache * cache, uint64_t min_age)
+{
+    uint32_t * list = cache->wb_list;
+    uint64_t now;
+    uint32_t cnt;
+    uint32_t i;
+    int ret;
+
+    lock_acquire(&cache->lock);
+
+    now = rdtime();
+    cnt = 0;
+
+    for (i = 0; i < cache->capacity; i++)
+    {
+        if (!CACHE_ISDIRTY(cache->table[i]))
+        {
+            continue;
+        }
+
+        if (now - cache->table[i].dirty_time < min_age)
+        {
+            continue;
+        }
+
+        list[cnt++] = i;
+    }
+
+    cache_sort(cache, list, cnt);
+    ret = 0;
+
+    for (i = 0; i < cnt; )
+    {
+        i += cache_write_run(cache, list + i, cnt - i, &ret);
+    }
+
+    cache_aio_drain(cache);
+    lock_release(&cache->lock);
+
+    return ret;
+}
+
+// Starts writing back the run of consecutive dirty blocks at the front of
+// _idxs_, up to CACHE_WB_MAX of them, with one asynchronous device request.
+// Entries cleaned since the list was built are skipped. Called with the table
+// lock held, which is dropped while waiting for a free request slot and while
+// the run is submitted. Returns the number of list entries consumed; a device
+// error is stored in _err_, when the request is reaped, if it does not hold
+// one already, so _err_ must stay valid until cache_aio_drain().
+
+uint32_t cache_write_run(struct cache * cache, const uint32_t * idxs,
+        uint32_t cnt, int * err)
+{
+    struct cache_aio * aio;
+    uint32_t used;
+    uint32_t n;
+    uint32_t i;
+
+    // the run is collected after the wait for a slot, which drops the lock
+
+    aio = cache_aio_get(cache, 1);
+    used = 0;
+    n = 0;
+
+    while (used < cnt && n < CACHE_WB_MAX)
+    {
+        if (!CACHE_ISDIRTY(cache->table[idxs[used]]))
+        {
+            used++;
+            continue;
+        }
+
+        if (n != 0 && cache->table[idxs[used]].block_id !=
+            cache->table[aio->idxs[n - 1]].block_id + 1)
+        {
+            break;
+        }
+
+        aio->idxs[n++] = idxs[used++];
+    }
+
+    if (n == 0)
+    {
+        aio->busy = 0;
+        return used;
+    }
+
+    // clean and pin the run, as cache_clean() does for a single block
+
+    for (i = 0; i < n; i++)
+    {
+        cache->table[aio->idxs[i]].pincnt++;
+        cache->table[aio->idxs[i]].flags &= ~CACHE_DIRTY;
+    }
+
+    cache->ndirty -= n;
+    aio->cnt = n;
+    aio->err = err;
+    lock_release(&cache->lock);
+
+    debug("writing back blocks=%d..%d", cache->table[aio->idxs[0]].block_id,
+        cache->table[aio->idxs[0]].block_id + n - 1);
+
+    cache_aio_submit(cache, aio, cache->table[aio->idxs[0]].block_id, 1);
+    lock_acquire(&cache->lock);
+
+    return used;
+}
+
+// Heapsorts the entry indices in _idxs_ by the block id they hold.
+
+void cache_sort(struct cache * cache, uint32_t * idxs, uint32_t cnt)
+{
+    uint32_t root;
+    uint32_t child;
+    uint32_t end;
+    uint32_t tmp;
+    uint32_t i;
+
+    for (end = cnt, i = cnt / 2; end > 1; )
+    {
+        if (i > 0)
+        {
+            root = --i; // build the heap
+        }
+        else
+        {
+            end--; // move the largest to the end
+            tmp = idxs[0];
+            idxs[0] = idxs[end];
+            idxs[end] = tmp;
+            root = 0;
+        }
+
+        while ((child = 2 * root + 1) < end)
+        {
+            if (child + 1 < end && cache->table[idxs[child + 1]].block_id >
+                cache->table[idxs[child]].block_id)
+            {
+                child++;
+            }
+
+            if (cache->table[idxs[root]].block_id >=
+                cache->table[idxs[child]].block_id)
+            {
+                break;
+            }
+
+            tmp = idxs[root];
+            idxs[root] = idxs[child];
+            idxs[child] = tmp;
+            root = child;
+        }
+    }
+}
+
+// Flusher thread of a write-back cache. Every CACHE_FLUSH_INTERVAL_MS it writes
+// back the blocks that have been dirty for longer than CACHE_DIRTY_AGE_MS, or
+// all of them when 1/CACHE_DIRTY_RATIO of the entries are dirty.
+
+void cache_flusher(struct cache * cache)
+{
+    const uint64_t max_age = CACHE_DIRTY_AGE_MS * (TIMER_FREQ / 1000);
+    int flush_all;
+
+    for (;;)
+    {
+        alarm_sleep_ms(&cache->flush_alarm, CACHE_FLUSH_INTERVAL_MS);
+
+        if (cache->ndirty == 0)
+        {
+            continue;
+        }
+
+        lock_acquire(&cache->wb_lock);
+        flush_all = (cache->ndirty >= cache->capacity / CACHE_DIRTY_RATIO);
+        cache_writeback(cache, flush_all ? 0 : max_age);
+        lock_release(&cache->wb_lock);
+    }
+}
+
+// Matches _block_id_ against the tracked sequential streams. Returns the stream
+// it continues, or NULL for a repeated or random access. A random access
+// recycles the least recently used stream to start following _block_id_, which
+// collapses that stream's window.
+
+struct cache_stream * cache_find_stream(struct cache * cache, uint64_t block_id)
+{
+    struct cache_stream * oldest;
+    struct cache_stream * s;
+
+    oldest = &cache->streams[0];
+
+    for (s = cache->streams; s < cache->streams + CACHE_RA_STREAMS; s++)
+    {
+        if (s->next == block_id)
+        {
+            s->next++;
+            s->stamp = ++cache->stream_clock;
+            return s;
+        }
+
+        if (s->next == block_id + 1)
+        {
+            s->stamp = ++cache->stream_clock;
+            return NULL;
+        }
+
+        if (s->stamp < oldest->stamp)
+        {
+            oldest = s;
+        }
+    }
+
+    oldest->next = block_id + 1;
+    oldest->window = 0;
+    oldest->hits = 0;
+    oldest->stamp = ++cache->stream_clock;
+
+    return NULL;
+}
+
+// Returns the number of blocks a miss on _stream_ should read and adapts the
+// stream's window: it doubles when the previous window was used up and halves
+// when prefetched blocks were evicted before use. A miss outside any stream
+// reads just the one block.
+
+uint32_t cache_ra_window(struct cache_stream * stream)
+{
+    if (stream == NULL)
+    {
+        return 1;
+    }
+
+    if (stream->window < CACHE_RA_MIN)
+    {
+        stream->window = CACHE_RA_MIN;
+    }
+    else if (stream->hits + 1 >= stream->window)
+    {
+        if (stream->window < CACHE_RA_MAX)
+        {
+            stream->window *= 2;
+        }
+    }
+    else if (stream->window / 2 >= CACHE_RA_MIN)
+    {
+        stream->window /= 2;
+    }
+
+    stream->hits = 0;
+
+    return stream->window;
+}
+
+// Frees an entry and returns its index, or CACHE_NIL if every entry is
+// pinned. Free entries are used first. Otherwise the cold queue gives up its
+// oldest block while it is over its share of the cache, remembering the id in
+// the ghost ring, and the hot queue is swept with the clock (second chance)
+// algorithm. Under CACHE_POLICY_CLOCK the cold queue only holds entries left
+// from an earlier 2Q period and is drained first. A dirty victim is written
+// back, with the table lock dropped, and taken if it is still unused after the
+// write. The returned entry is on no queue.
+
+uint32_t cache_evict(struct cache * cache)
+{
+    struct cache_queue * q;
+    uint32_t tries;
+    uint32_t kin;
+    uint32_t idx;
+
+    for (tries = 0; tries < cache->capacity; tries++)
+    {
+        if (cache->free.cnt != 0)
+        {
+            idx = cache->free.head;
+            cache_queue_remove(cache, &cache->free, idx);
+            return idx;
+        }
+
+        kin = 0;
+
+        if (cache->policy == CACHE_POLICY_2Q)
+        {
+            kin = cache->capacity / CACHE_2Q_KIN_RATIO;
+        }
+
+        idx = CACHE_NIL;
+
+        if (cache->cold.cnt > kin || cache->hot.cnt == 0)
+        {
+            idx = cache_reclaim(cache, &cache->cold, 0);
+        }
+
+        if (idx == CACHE_NIL)
+        {
+            idx = cache_reclaim(cache, &cache->hot, 1);
+        }
+
+        if (idx == CACHE_NIL)
+        {
+            idx = cache_reclaim(cache, &cache->cold, 0);
+        }
+
+        if (idx == CACHE_NIL)
+        {
+            return CACHE_NIL;
+        }
+
+        if (!CACHE_ISDIRTY(cache->table[idx]))
+        {
+            break;
+        }
+
+        q = cache_entry_queue(cache, idx);
+        cache_queue_push(cache, q, idx);
+        cache_clean(cache, idx);
+
+        if (!CACHE_ISDIRTY(cache->table[idx]) &&
+            !CACHE_ISPINNED(cache->table[idx]))
+        {
+            cache_queue_remove(cache, q, idx);
+            break;
+        }
+    }
+
+    if (tries == cache->capacity)
+    {
+        return CACHE_NIL;
+    }
+
+    debug("replacing block=%ld in cache", cache->table[idx].block_id);
+    cache->stats.evictions++;
+
+    // a prefetched block that was never read has no claim to come back hot
+
+    if (cache->policy == CACHE_POLICY_2Q && !CACHE_ISHOT(cache->table[idx]) &&
+        !CACHE_ISRAHEAD(cache->table[idx]))
+    {
+        cache_ghost_insert(cache, cache->table[idx].block_id);
+    }
+
+    cache_hash_remove(cache, idx);
+    cache->table[idx].flags = 0;
+
+    return idx;
+}
+
+// Reads _cnt_ blocks starting at _block_id_ into the cache. The first _npin_
+// of them are pinned for the caller and read before returning. The rest are
+// prefetched by an asynchronous request that the caller does not wait for,
+// and the prefetch is dropped if every request slot is in use.
+// The run is cut short at the first block that is already resident and at the
+// end of the device. With _noread_ set, no request is made and the entries are
+// left CACHE_BUSY for the caller to fill in. Called with the table lock held.
+// The new entries are indexed and flagged CACHE_BUSY before the lock is
+// dropped for the read, so concurrent misses on them wait instead of reading
+// them again. Returns the number of blocks filled, with the prefetched entries
+// flagged CACHE_RAHEAD, or 0 if another thread started reading _block_id_
+// while this one was freeing an entry. New entries go on the cold or hot queue
+// according to the replacement policy.
+
+int cache_fill(struct cache * cache, uint64_t block_id,
+        uint32_t cnt, uint32_t npin, int noread)
+{
+    struct cache_entry * entry;
+    struct cache_aio * aio;
+    struct ioreq req;
+    struct ioseg segs[CACHE_RA_MAX];
+    uint32_t idxs[CACHE_RA_MAX];
+    uint32_t idx;
+    uint32_t n;
+    uint32_t nread;
+    long result;
+    int ghost;
+
+    if (CACHE_RA_MAX < cnt)
+    {
+        cnt = CACHE_RA_MAX;
+    }
+
+    if (cache->end_block - block_id < cnt)
+    {
+        cnt = cache->end_block - block_id;
+    }
+
+    cache_reap(cache);
+    aio = NULL;
+
+    if (cnt > npin && !noread)
+    {
+        aio = cache_aio_get(cache, 0);
+
+        if (aio == NULL)
+        {
+            cnt = npin;
+        }
+    }
+
+    for (n = 0; n < cnt; n++)
+    {
+        if (n != 0 && cache_lookup(cache, block_id + n) != CACHE_NIL)
+        {
+            break;
+        }
+
+        idx = cache_evict(cache);
+
+        if (idx == CACHE_NIL)
+        {
+            break;
+        }
+
+        // writing back a dirty victim drops the table lock
+
+        if (cache_lookup(cache, block_id + n) != CACHE_NIL)
+        {
+            cache_queue_push(cache, &cache->free, idx);
+            break;
+        }
+
+        entry = &cache->table[idx];
+        entry->block_id = block_id + n;
+        entry->flags = CACHE_VALID | CACHE_BUSY;
+        entry->pincnt = 0;
+        cache_hash_insert(cache, idx);
+
+        // under 2Q only a block missed again after a cold eviction is hot, and
+        // a resident block is never also a ghost
+
+        ghost = cache_ghost_remove(cache, block_id + n);
+
+        if (cache->policy == CACHE_POLICY_CLOCK || (n < npin && ghost))
+        {
+            if (cache->policy == CACHE_POLICY_2Q)
+            {
+                cache->stats.hot_admits++;
+            }
+
+            entry->flags |= CACHE_HOT;
+            cache_queue_push(cache, &cache->hot, idx);
+        }
+        else
+        {
+            cache_queue_push(cache, &cache->cold, idx);
+        }
+
+        if (n < npin)
+        {
+            entry->pincnt = 1;
+        }
+        else
+        {
+            entry->flags |= CACHE_RAHEAD;
+        }
+
+        idxs[n] = idx;
+    }
+
+    // the run may have stopped before reaching the readahead
+
+    if (aio != NULL && n <= npin)
+    {
+        aio->busy = 0;
+        aio = NULL;
+    }
+
+    if (n == 0)
+    {
+        if (cache_lookup(cache, block_id) != CACHE_NIL)
+        {
+            return 0;
+        }
+
+        return -EBUSY;
+    }
+
+    if (noread)
+    {
+        return n;
+    }
+
+    nread = (n < npin) ? n : npin;
+
+    if (aio != NULL)
+    {
+        aio->cnt = n - nread;
+        memcpy(aio->idxs, idxs + nread, aio->cnt * sizeof(uint32_t));
+    }
+
+    debug("filling block=%ld cnt=%d readahead=%d", block_id, nread, n - nread);
+
+    lock_release(&cache->lock);
+
+    // the caller's blocks go to the device first, the readahead right behind
+    // them, and only the former are waited for
+
+    req.pos = block_id * CACHE_BLKSZ;
+    req.len = nread * CACHE_BLKSZ;
+    req.segs = segs;
+    req.segcnt = cache_segs(cache, idxs, nread, segs);
+    req.write = 0;
+    req.callback = NULL;
+
+    result = iosubmit(cache->backend, &req);
+
+    if (aio != NULL)
+    {
+        cache_aio_submit(cache, aio, block_id + nread, 0);
+    }
+
+    if (result == 0)
+    {
+        result = iowait(&req);
+    }
+
+    lock_acquire(&cache->lock);
+
+    for (uint32_t i = 0; i < nread; i++)
+    {
+        if (result < 0)
+        {
+            cache_discard(cache, idxs[i]);
+            continue;
+        }
+
+        cache->table[idxs[i]].flags &= ~CACHE_BUSY;
+    }
+
+    condition_broadcast(&cache->io_done);
+
+    if (result < 0)
+    {
+        return result;
+    }
+
+    return n;
+}
+
+// Claims a free asynchronous request slot. Slots whose requests have completed
+// are reaped first. If none is free, returns NULL, or with _wait_ set sleeps
+// until one is, which drops the table lock. Called with the table lock held.
+
+struct cache_aio * cache_aio_get(struct cache * cache, int wait)
+{
+    for (;;)
+    {
+        cache_reap(cache);
+
+        for (int i = 0; i < CACHE_AIO_MAX; i++)
+        {
+            if (!cache->aio[i].busy)
+            {
+                cache->aio[i].busy = 1;
+                cache->aio[i].err = NULL;
+                return &cache->aio[i];
+            }
+        }
+
+        if (!wait)
+        {
+            return NULL;
+        }
+
+        cache_wait_io(cache);
+    }
+}
+
+// Starts the request of slot _aio_, which reads or writes its entries from
+// _block_id_ on. Called without the table lock. A request the backend refuses
+// is completed here with its error, so that reaping it puts the entries back
+// in order.
+
+void cache_aio_submit(struct cache * cache, struct cache_aio * aio,
+        uint64_t block_id, int write)
+{
+    struct ioseg segs[CACHE_AIO_BLKS];
+    int result;
+
+    aio->req.pos = block_id * CACHE_BLKSZ;
+    aio->req.len = aio->cnt * CACHE_BLKSZ;
+    aio->req.segs = segs;
+    aio->req.segcnt = cache_segs(cache, aio->idxs, aio->cnt, segs);
+    aio->req.write = write;
+    aio->req.callback = &cache_aio_done;
+    aio->req.aux = cache;
+
+    result = iosubmit(cache->backend, &aio->req);
+
+    if (result < 0)
+    {
+        aio->req.result = result;
+        aio->req.done = 1;
+        condition_broadcast(&cache->io_done);
+    }
+}
+
+// Completion callback of an asynchronous request. It may run in an ISR, so it
+// only wakes the threads that reap requests; the entries are updated by
+// cache_reap() under the table lock.
+
+void cache_aio_done(struct ioreq * req)
+{
+    struct cache * const cache = req->aux;
+
+    condition_broadcast(&cache->io_done);
+}
+
+// Finishes every completed asynchronous request. Readahead entries become
+// visible, or are dropped if the read failed. Written blocks are unpinned,
+// and dirtied again if the write failed.
+// Returns the number of slots freed. Called with the table lock held.
+
+uint32_t cache_reap(struct cache * cache)
+{
+    struct cache_aio * aio;
+    uint32_t reaped;
+    uint32_t idx;
+    long result;
+
+    reaped = 0;
+
+    for (int i = 0; i < CACHE_AIO_MAX; i++)
+    {
+        aio = &cache->aio[i];
+
+        if (!aio->busy || !iopoll(&aio->req))
+        {
+            continue;
+        }
+
+        result = aio->req.result;
+
+        for (uint32_t j = 0; j < aio->cnt; j++)
+        {
+            idx = aio->idxs[j];
+
+            if (aio->req.write)
+            {
+                if (result < 0)
+                {
+                    cache_mark_dirty(cache, idx);
+                }
+
+                cache_drop_pin(cache, idx);
+            }
+            else if (result < 0)
+            {
+                cache_discard(cache, idx);
+            }
+            else
+            {
+                cache->table[idx].flags &= ~CACHE_BUSY;
+                cache->stats.ra_blocks++;
+            }
+        }
+
+        if (result < 0 && aio->err != NULL && *aio->err == 0)
+        {
+            *aio->err = result;
+        }
+        else if (result >= 0 && aio->req.write)
+        {
+            cache->stats.writebacks += aio->cnt;
+        }
+
+        aio->busy = 0;
+        reaped++;
+    }
+
+    if (reaped != 0)
+    {
+        condition_broadcast(&cache->io_done);
+    }
+
+    return reaped;
+}
+
+// Describes the blocks of the _cnt_ entries in _idxs_, in that order, as a list
+// of segments for a device request, merging the blocks of neighbouring
+// entries. Returns the number of segments stored in _segs_, which must have
+// room for _cnt_.
+
+int cache_segs(struct cache * cache, const uint32_t * idxs, uint32_t cnt,
+        struct ioseg * segs)
+{
+    int n;
+
+    n = 0;
+
+    for (uint32_t i = 0; i < cnt; i++)
+    {
+        if (n != 0 && idxs[i] == idxs[i - 1] + 1)
+        {
+            segs[n - 1].len += CACHE_BLKSZ;
+            continue;
+        }
+
+        segs[n].buf = CACHE_BLOCK(cache, idxs[i]);
+        segs[n].len = CACHE_BLKSZ;
+        n++;
+    }
+
+    return n;
+}
+
+// Sleeps until no asynchronous request is in flight. Called with the table
+// lock held, which is dropped while waiting.
+
+void cache_aio_drain(struct cache * cache)
+{
+    for (int i = 0; i < CACHE_AIO_MAX; i++)
+    {
+        while (cache->aio[i].busy)
+        {
+            cache_wait_io(cache);
+        }
+    }
+}
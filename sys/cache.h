@@ -7,9 +7,44 @@
 #ifndef _CACHE_H_
 #define _CACHE_H_
 
-struct cache; // opaque decl.
+#include <stdint.h>
 
-extern int create_cache(struct io * bkgio, struct cache ** cptr);
+struct cache; // opaque decl.
+
+// Counters kept by each cache since it was created, returned by the
+// IOCTL_GETCACHESTATS ioctl. Latencies are in rdtime() ticks.
+
+struct cache_stats
+{
+    uint64_t hits;          // cache_get_block() found the block resident
+    uint64_t misses;        // cache_get_block() had to read the block
+    uint64_t fill_waits;    // waited for another thread to read the block
+    uint64_t miss_ticks;    // total time spent servicing misses
+    uint64_t ra_blocks;     // blocks read ahead of a sequential stream
+    uint64_t ra_hits;       // read-ahead blocks that were used
+    uint64_t evictions;     // resident blocks replaced
+    uint64_t hot_admits;    // 2Q blocks admitted to the hot queue
+    uint64_t writebacks;    // dirty blocks written to the device
+};
+
+// Write policies accepted by create_cache(). A write-through cache writes a
+// dirty block to the backing device when it is released. A write-back cache
+// keeps it resident and leaves the write to a background flusher thread,
+// eviction, or cache_flush().
+
+#define CACHE_WRITETHROUGH  0
+#define CACHE_WRITEBACK     1
+
+// Replacement policies. CACHE_POLICY_CLOCK runs every entry on a single clock.
+// CACHE_POLICY_2Q keeps blocks that were only used once, such as those of a
+// large sequential read, on a separate cold queue so they cannot push out the
+// frequently used ones.
+
+#define CACHE_POLICY_CLOCK  0
+#define CACHE_POLICY_2Q     1
+
+extern int create_cache (
+        struct io * bkgio, uint32_t capacity, int mode, struct cache ** cptr);
 extern int cache_get_block (
         struct cache * cache, unsigned long long pos, void ** pptr);
 
@@ -20,7 +55,48 @@ extern int cache_writeat (
         struct cache * cache, unsigned long long pos, const void * buf,
         long bufsz);
 
+// A byte range on the backing device and the buffer it is copied from or to.
+
+struct cache_iov
+{
+    unsigned long long pos;
+    void * buf;
+    long len;
+};
+
+// Copy the ranges in _iov_ out of or into the cache. A range may span any
+// number of blocks, and the blocks missing from the cache are read with as few
+// device requests as possible. Return the number of bytes copied, or a
+// negative error if none were. cache_readat() and cache_writeat() are the
+// single-range forms.
+
+extern long cache_readv (
+        struct cache * cache, const struct cache_iov * iov, int iovcnt);
+extern long cache_writev (
+        struct cache * cache, const struct cache_iov * iov, int iovcnt);
+
 extern void cache_release_block(struct cache * cache, void * pblk, int dirty);
 extern int cache_flush(struct cache * cache);
 
+// Drops the blocks of the device range at _pos_ of _len_ bytes from the cache,
+// dirty or not, after any I/O in flight on them completes. Called before the
+// range is discarded or zeroed on the device, so that neither a stale cached
+// copy nor a later write-back of one hides the change. Returns 0, or -EINVAL
+// if the range is not made of whole blocks.
+
+extern int cache_invalidate (
+        struct cache * cache, unsigned long long pos, unsigned long long len);
+
+// Handles cache ioctls: IOCTL_GETCACHESZ and IOCTL_SETCACHESZ read and change
+// the number of entries, IOCTL_GETCACHEPOLICY and IOCTL_SETCACHEPOLICY the
+// replacement policy, and IOCTL_GETCACHESTATS copies out the struct
+// cache_stats. Returns -ENOTSUP for any other command. KTFS files pass on only
+// the IOCTL_GET* commands, so the setters are reachable from the kernel alone.
+
+extern int cache_cntl(struct cache * cache, int cmd, void * arg);
+
+// Prints the cache's configuration and counters to the console.
+
+extern void cache_dump_stats(struct cache * cache);
+
 #endif // _CACHE_H_
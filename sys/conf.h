@@ -108,9 +108,12 @@
 
 #define PROCESS_IOMAX 16
 
-// Capacity of block cache
+// Initial capacity of the block cache in entries. It can be changed at run
+// time by passing IOCTL_SETCACHESZ to cache_cntl().
 
-#define CACHE_CAPACITY 64 // must be power of two
+#ifndef CACHE_CAPACITY
+#define CACHE_CAPACITY 64 // must be power of two
+#endif
 
 // KERNEL FEATURES
 //
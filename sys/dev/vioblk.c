@@ -22,6 +22,7 @@
 #include "thread.h"
 #include "error.h"
 #include "string.h"
+#include "memory.h"
 #include "conf.h"
 
 #include <limits.h>
@@ -37,6 +38,44 @@
 #define VIOBLK_NAME "vioblk"
 #endif
 
+// Largest transfer a single request makes through its bounce buffer, and the
+// most data descriptors a request may use. The device's size_max and seg_max
+// can lower both.
+
+#ifndef VIOBLK_XFER_MAX
+#define VIOBLK_XFER_MAX (16 * 1024)
+#endif
+
+#ifndef VIOBLK_SEG_MAX
+#define VIOBLK_SEG_MAX 16
+#endif
+
+// Number of requests that can be in flight at once, and the largest virtqueue
+// used. The queue (descriptors and both rings) must fit in one page.
+
+#ifndef VIOBLK_REQ_MAX
+#define VIOBLK_REQ_MAX 8
+#endif
+
+#define VIOBLK_QLEN_MAX 128
+
+// Most virtqueues used when the device offers several (VIRTIO_BLK_F_MQ). A
+// synchronous transfer goes on the queue of the thread making it, and each
+// asynchronous request, usually submitted by a thread working for several
+// others, on the next queue in turn.
+
+#ifndef VIOBLK_QUEUE_MAX
+#define VIOBLK_QUEUE_MAX 4
+#endif
+
+// With VIRTIO_F_EVENT_IDX, the completion interrupt is put off until about
+// 1/VIOBLK_INTR_COALESCE of the requests in flight have completed. Every
+// request in flight completes, so the interrupt is sure to come.
+
+#ifndef VIOBLK_INTR_COALESCE
+#define VIOBLK_INTR_COALESCE 4
+#endif
+
 // INTERNAL CONSTANT DEFINITIONS
 //
 
@@ -76,29 +115,27 @@
 #define VIRTIO_BLK_REQ_HEADER_SIZE 16
 #define VIRTIO_BLK_REQ_SECTOR_SIZE 512
 #define VIRTIO_BLK_REQ_FOOTER_SIZE 1
-#define VIRTIO_BLK_VIRTQ_LEN 3
 
  // INTERNAL TYPE DEFINITIONS
  //
 
+// Occupies a page of its own so that the device sees it physically contiguous.
+
 struct vioblk_virtq
 {
-    uint16_t last_seen; // last used ring buffer serviced
+    struct virtq_desc desc[VIOBLK_QLEN_MAX];
 
     union
     {
         struct virtq_avail avail;
-        char _avail_filler[VIRTQ_AVAIL_SIZE(VIRTIO_BLK_VIRTQ_LEN)];
+        char _avail_filler[VIRTQ_AVAIL_SIZE(VIOBLK_QLEN_MAX)];
     };
 
     union
     {
         struct virtq_used used;
-        char _used_filler[VIRTQ_USED_SIZE(VIRTIO_BLK_VIRTQ_LEN)];
+        char _used_filler[VIRTQ_USED_SIZE(VIOBLK_QLEN_MAX)];
     };
-
-    struct virtq_desc indirect_desc;
-    struct virtq_desc desc_table[VIRTIO_BLK_VIRTQ_LEN];
 };
 
 struct vioblk_config
@@ -139,13 +176,59 @@ struct vioblk_config
     uint32_t secure_erase_sector_alignment;
 };
 
+// Data of a discard or write-zeroes request, read by the device. Sectors are
+// always 512 bytes here, whatever the block size.
+
+struct vioblk_range
+{
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+};
+
+// The first three fields are the request header read by the device, and
+// status is written by it.
+
 struct vioblk_request
 {
     uint32_t type;  // read, write, discard, etc...
     uint32_t reserved;
     uint64_t sector; // offset * block size where read or write is
-    char data[VIRTIO_BLK_REQ_SECTOR_SIZE];
     uint8_t status;
+
+    volatile uint8_t done;  // set by vioblk_isr()
+    uint8_t busy;           // taken from the pool
+    uint16_t head;          // first descriptor of the chain
+    uint16_t ndesc;         // descriptors in the chain
+    uint32_t len;           // bytes of data
+    uint8_t qidx;           // virtqueue the request is on
+    char * bounce;          // VIOBLK_XFER_MAX bytes of physical memory
+
+    uint8_t direct;         // data descriptors point at the caller's buffers
+    void * buf;             // caller's buffer of a bounced request
+    struct ioreq * ioreq;   // asynchronous request this is part of, or NULL
+};
+
+// A position in a list of data segments.
+
+struct vioblk_cursor
+{
+    const struct ioseg * seg;
+    long off;
+};
+
+// A virtqueue and the driver's view of it.
+
+struct vioblk_queue
+{
+    struct vioblk_virtq * virtq;
+    uint16_t qid;           // queue number on the device
+    uint16_t last_seen;     // last used ring buffer serviced
+    uint16_t desc_free;     // free descriptors, chained through next
+    uint16_t desc_nfree;
+    uint16_t kick_idx;      // avail idx when the device was last notified
+    uint16_t inflight;      // requests made available and not yet used
+    uint8_t head_req[VIOBLK_QLEN_MAX]; // request of each chain head
 };
 
 struct vioblk_device
@@ -155,20 +238,30 @@ struct vioblk_device
     int irqno;
     int instno;
 
-    struct vioblk_virtq virtq;
     struct vioblk_config * conf;
 
-    struct condition ready;
-    struct lock lock;
-};
+    struct vioblk_queue queues[VIOBLK_QUEUE_MAX];
+    uint16_t nq;            // virtqueues in use
+    uint16_t next_q;        // queue of the next asynchronous request
+    uint16_t qlen;          // size of every virtqueue, a power of two
+    int event_idx;          // VIRTIO_F_EVENT_IDX negotiated
 
-// GLOBAL VARIABLE DECLARATIONS
-//
+    // The request pool is shared by all the queues.
 
-// TODO: make per request buffers
-// I can do this by having some pre allocated requests then
-// cycling through them whenever something requests data
-static struct vioblk_request req;
+    struct vioblk_request reqs[VIOBLK_REQ_MAX];
+    uint32_t seg_size;  // largest data descriptor
+    uint32_t seg_cnt;   // most data descriptors per request
+    uint32_t xfer_max;  // largest transfer per request
+    uint32_t discard_max;   // sectors per discard, 0 if not supported
+    uint32_t wrzeroes_max;  // sectors per write-zeroes, 0 if not supported
+    int flush;              // VIRTIO_BLK_F_FLUSH negotiated
+
+    // The pool, the descriptor free lists and the available rings are also
+    // used by the ISR, which finishes asynchronous requests, so they are
+    // protected by disabling interrupts.
+
+    struct condition ready; // a request completed or was freed
+};
 
 // INTERNAL FUNCTION DECLARATIONS
 //
@@ -180,33 +273,81 @@ static long vioblk_readat(struct io * io, unsigned long long pos, void * buf,
 static long vioblk_writeat(struct io * io, unsigned long long pos,
         const void * buf, long len);
 static int vioblk_cntl(struct io * io, int cmd, void * arg);
+static int vioblk_submit(struct io * io, struct ioreq * ioreq);
 
 static void vioblk_isr(int srcno, void * aux);
+static void vioblk_service (
+        struct vioblk_device * vioblk,
+        struct vioblk_queue * q);
+
+static long vioblk_transfer (
+        struct vioblk_device * vioblk,
+        uint32_t type,
+        uint64_t sector,
+        const struct ioseg * segs,
+        long len);
+
+static int vioblk_range (
+        struct vioblk_device * vioblk,
+        uint32_t type,
+        const struct iorange * range);
+
+static int vioblk_flush(struct vioblk_device * vioblk);
 
-static int request_block (
+static int vioblk_dmaable(const struct ioseg * seg);
+
+static struct vioblk_queue * vioblk_thread_queue (
+        struct vioblk_device * vioblk);
+
+static uint32_t vioblk_start (
         struct vioblk_device * vioblk,
+        struct vioblk_queue * q,
         uint32_t type,
         uint64_t sector,
-        uint32_t queue,
-        uint32_t queue_max);
+        struct vioblk_cursor * cur,
+        long rem,
+        int wait,
+        struct ioreq * ioreq,
+        struct vioblk_request ** reqptr);
+
+static int vioblk_finish (
+        struct vioblk_device * vioblk,
+        struct vioblk_request * req);
+
+static void vioblk_release (
+        struct vioblk_device * vioblk,
+        struct vioblk_request * req);
+
+static void vioblk_kick (
+        struct vioblk_device * vioblk,
+        struct vioblk_queue * q);
 
 // EXPORTED FUNCTION DEFINITIONS
 //
 
 // Attaches a VirtIO block device. Declared and called directly from virtio.c
 
-// Negotiate features. We need:
-//  - VIRTIO_F_RING_RESET and
-//  - VIRTIO_F_INDIRECT_DESC
+// Negotiate features. We need:
+//  - VIRTIO_F_RING_RESET
 // We want:
-//  - VIRTIO_BLK_F_BLK_SIZE and
-//  - VIRTIO_BLK_F_TOPOLOGY.
+//  - VIRTIO_BLK_F_BLK_SIZE,
+//  - VIRTIO_BLK_F_TOPOLOGY,
+//  - VIRTIO_BLK_F_SIZE_MAX and
+//  - VIRTIO_BLK_F_SEG_MAX, which bound the data descriptors of a request,
+//  - VIRTIO_F_EVENT_IDX, to batch notifications and coalesce interrupts,
+//  - VIRTIO_BLK_F_DISCARD and VIRTIO_BLK_F_WRITE_ZEROES, for the
+//    IOCTL_DISCARD and IOCTL_WRZEROES ioctls,
+//  - VIRTIO_BLK_F_FLUSH and VIRTIO_BLK_F_CONFIG_WCE, to run the device's
+//    write cache in write-back mode and flush it on IOCTL_FLUSH,
+//  - VIRTIO_BLK_F_MQ, to spread requests over several virtqueues.
 
 void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno)
 {
     struct vioblk_device * vioblk;
     struct vioblk_config * conf;
+    struct vioblk_queue * queue;
     uint32_t blk_size;
+    char * bounce;
     int result;
 
     assert (regs->device_id == VIRTIO_ID_BLOCK);
@@ -218,10 +359,17 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno)
 
     virtio_featset_init(needed_features);
     virtio_featset_add(needed_features, VIRTIO_F_RING_RESET);
-    virtio_featset_add(needed_features, VIRTIO_F_INDIRECT_DESC);
     virtio_featset_init(wanted_features);
     virtio_featset_add(wanted_features, VIRTIO_BLK_F_BLK_SIZE);
     virtio_featset_add(wanted_features, VIRTIO_BLK_F_TOPOLOGY);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_SIZE_MAX);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_SEG_MAX);
+    virtio_featset_add(wanted_features, VIRTIO_F_EVENT_IDX);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_DISCARD);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_WRITE_ZEROES);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_FLUSH);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_CONFIG_WCE);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_MQ);
 
     result = virtio_negotiate_features(regs, enabled_features,
             wanted_features, needed_features);
@@ -257,8 +405,109 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno)
     vioblk->regs = regs;
     vioblk->irqno = irqno;
     vioblk->conf = conf;
+    vioblk->event_idx =
+        virtio_featset_test(enabled_features, VIRTIO_F_EVENT_IDX);
     condition_init(&vioblk->ready, "virtio block ready");
-    lock_init(&vioblk->lock);
+
+    // split each transfer into as few data descriptors as the device allows
+
+    vioblk->seg_size = VIOBLK_XFER_MAX;
+    vioblk->seg_cnt = VIOBLK_SEG_MAX;
+
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_SIZE_MAX) &&
+        conf->size_max < vioblk->seg_size)
+    {
+        vioblk->seg_size = conf->size_max / VIRTIO_BLK_REQ_SECTOR_SIZE;
+        vioblk->seg_size *= VIRTIO_BLK_REQ_SECTOR_SIZE;
+
+        if (vioblk->seg_size == 0)
+        {
+            vioblk->seg_size = VIRTIO_BLK_REQ_SECTOR_SIZE;
+        }
+    }
+
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_SEG_MAX) &&
+        conf->seg_max != 0 && conf->seg_max < vioblk->seg_cnt)
+    {
+        vioblk->seg_cnt = conf->seg_max;
+    }
+
+    vioblk->xfer_max = vioblk->seg_size * vioblk->seg_cnt;
+
+    if (vioblk->xfer_max > VIOBLK_XFER_MAX)
+    {
+        vioblk->xfer_max = VIOBLK_XFER_MAX;
+    }
+
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_DISCARD))
+    {
+        vioblk->discard_max = conf->max_discard_sectors;
+    }
+
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_WRITE_ZEROES))
+    {
+        vioblk->wrzeroes_max = conf->max_write_zeroes_sectors;
+    }
+
+    // with a flush command to order writes, the device may complete them
+    // from its write cache; without one it must write them through
+
+    vioblk->flush = virtio_featset_test(enabled_features, VIRTIO_BLK_F_FLUSH);
+
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_CONFIG_WCE))
+    {
+        conf->writeback = vioblk->flush;
+    }
+
+    vioblk->nq = 1;
+
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_MQ) &&
+        conf->num_queues > 1)
+    {
+        vioblk->nq = conf->num_queues;
+
+        if (vioblk->nq > VIOBLK_QUEUE_MAX)
+        {
+            vioblk->nq = VIOBLK_QUEUE_MAX;
+        }
+    }
+
+    // the largest power of two every queue and VIOBLK_QLEN_MAX allow
+
+    vioblk->qlen = VIOBLK_QLEN_MAX;
+
+    for (int q = 0; q < vioblk->nq; q++)
+    {
+        regs->queue_sel = q;
+        __sync_synchronize();
+
+        while (vioblk->qlen > regs->queue_num_max)
+        {
+            vioblk->qlen /= 2;
+        }
+    }
+
+    // a request must fit in the queue on its own
+
+    if (vioblk->seg_cnt > vioblk->qlen - 2u)
+    {
+        vioblk->seg_cnt = vioblk->qlen - 2;
+        vioblk->xfer_max = vioblk->seg_size * vioblk->seg_cnt;
+
+        if (vioblk->xfer_max > VIOBLK_XFER_MAX)
+        {
+            vioblk->xfer_max = VIOBLK_XFER_MAX;
+        }
+    }
+
+    // each request has a bounce buffer of its own, so they can overlap
+
+    bounce = alloc_phys_pages(VIOBLK_REQ_MAX * VIOBLK_XFER_MAX / PAGE_SIZE);
+
+    for (int i = 0; i < VIOBLK_REQ_MAX; i++)
+    {
+        vioblk->reqs[i].bounce = bounce + i * VIOBLK_XFER_MAX;
+    }
 
     static const struct iointf vioblk_iointf =
     {
@@ -266,6 +515,7 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno)
         .cntl = &vioblk_cntl,
         .readat = &vioblk_readat,
         .writeat = &vioblk_writeat,
+        .submit = &vioblk_submit,
     };
 
     ioinit0(&vioblk->io, &vioblk_iointf);
@@ -276,22 +526,40 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno)
     kprintf("block size=%d\n", vioblk->conf->blk_size);
     kprintf("queue max=%u\n", regs->queue_num_max);
 
-    // attach virtqueue
-
-    vioblk->virtq.indirect_desc.addr = (uint64_t)&vioblk->virtq.desc_table[0];
-    vioblk->virtq.indirect_desc.len = VIRTQ_DESC_SIZE * VIRTIO_BLK_VIRTQ_LEN;
-    vioblk->virtq.indirect_desc.flags = VIRTQ_DESC_F_INDIRECT;
-    vioblk->virtq.indirect_desc.next = 0;
+    debug("transfer max=%u queue len=%u queues=%u write cache=%s",
+        vioblk->xfer_max, vioblk->qlen, vioblk->nq,
+        vioblk->flush ? "write-back" : "write-through");
 
-    virtio_attach_virtq(regs, 0, 1, (uint64_t)&vioblk->virtq.indirect_desc,
-        (uint64_t)&vioblk->virtq.used, (uint64_t)&vioblk->virtq.avail);
-    virtio_enable_virtq(regs, 0);
+    // attach virtqueues
 
-    if (regs->queue_ready != 1)
+    for (int q = 0; q < vioblk->nq; q++)
     {
-        kprintf("%p: failed queue %d not ready\n", regs, 0);
-        regs->status |= VIRTIO_STAT_FAILED;
-        return;
+        queue = &vioblk->queues[q];
+        queue->qid = q;
+        queue->virtq = alloc_phys_page();
+        memset(queue->virtq, 0, sizeof(struct vioblk_virtq));
+
+        // every descriptor starts out on the free list
+
+        for (int i = 0; i < vioblk->qlen; i++)
+        {
+            queue->virtq->desc[i].next = i + 1;
+        }
+
+        queue->desc_free = 0;
+        queue->desc_nfree = vioblk->qlen;
+
+        virtio_attach_virtq(regs, q, vioblk->qlen,
+            (uint64_t)queue->virtq->desc, (uint64_t)&queue->virtq->used,
+            (uint64_t)&queue->virtq->avail);
+        virtio_enable_virtq(regs, q);
+
+        if (regs->queue_ready != 1)
+        {
+            kprintf("%p: failed queue %d not ready\n", regs, q);
+            regs->status |= VIRTIO_STAT_FAILED;
+            return;
+        }
     }
 
     regs->interrupt_ack = regs->interrupt_status;
@@ -316,7 +584,11 @@ void vioblk_close(struct io * io)
         (void*)io - offsetof(struct vioblk_device, io);
 
     disable_intr_source(vioblk->irqno);
-    virtio_reset_virtq(vioblk->regs, 0);
+
+    for (int q = 0; q < vioblk->nq; q++)
+    {
+        virtio_reset_virtq(vioblk->regs, q);
+    }
 }
 
 long vioblk_readat(struct io * io, unsigned long long  pos, void * buf,
@@ -325,12 +597,11 @@ long vioblk_readat(struct io * io, unsigned long long  pos, void * buf,
     struct vioblk_device * const vioblk =
         (void*)io - offsetof(struct vioblk_device, io);
 
+    struct ioseg seg;
     uint64_t capacity;
     uint32_t blk_size;
     uint64_t sector;
-    uint64_t read_bytes;
 
-    lock_acquire(&vioblk->lock);
     trace("%s(pos=%lld, bufsz=%ld)", __func__, pos, bufsz);
 
     capacity = vioblk->conf->capacity;
@@ -346,30 +617,17 @@ long vioblk_readat(struct io * io, unsigned long long  pos, void * buf,
     }
 
     sector = pos / blk_size;
-    read_bytes = 0;
 
-    while (read_bytes < bufsz)
+    // make sure we are not trying to read more than hard-drive capacity
+    if (sector + bufsz / blk_size > capacity)
     {
-        // make sure we are not trying to read more than hard-drive capacity
-        if (sector > capacity)
-        {
-            return -EACCESS;
-        }
-
-        request_block(vioblk, VIRTIO_BLK_T_IN, sector, 0, 1);
-        memcpy(buf + read_bytes, req.data, blk_size);
-        read_bytes += blk_size;
-
-        debug("sector=%lld", sector);
-        debug("read_bytes=%lld", read_bytes);
-
-        sector++;
+        return -EACCESS;
     }
 
-    __sync_synchronize();
-    lock_release(&vioblk->lock);
+    seg.buf = buf;
+    seg.len = bufsz;
 
-    return read_bytes;
+    return vioblk_transfer(vioblk, VIRTIO_BLK_T_IN, sector, &seg, bufsz);
 }
 
 long vioblk_writeat(struct io * io, unsigned long long pos, const void * buf,
@@ -378,12 +636,11 @@ long vioblk_writeat(struct io * io, unsigned long long pos, const void * buf,
     struct vioblk_device * const vioblk =
         (void*)io - offsetof(struct vioblk_device, io);
 
+    struct ioseg seg;
     uint64_t capacity;
     uint32_t blk_size;
     uint64_t sector;
-    uint64_t write_bytes;
 
-    lock_acquire(&vioblk->lock);
     trace("%s(pos=%lld, len=%ld)", __func__, pos, len);
 
     capacity = vioblk->conf->capacity;
@@ -400,30 +657,115 @@ long vioblk_writeat(struct io * io, unsigned long long pos, const void * buf,
     }
 
     sector = pos / blk_size;
-    write_bytes = 0;
 
-    while (write_bytes < len)
+    // make sure we are not trying to write more than hard-drive capacity
+    if (sector + len / blk_size > capacity)
+    {
+        return -EACCESS;
+    }
+
+    seg.buf = (void *)buf;
+    seg.len = len;
+
+    return vioblk_transfer(vioblk, VIRTIO_BLK_T_OUT, sector, &seg, len);
+}
+
+// Starts _ioreq_ as a series of requests that are finished by vioblk_isr().
+// Only waits if the pool is exhausted. The priv member of _ioreq_ counts its
+// requests still in flight, plus one while they are being started.
+
+int vioblk_submit(struct io * io, struct ioreq * ioreq)
+{
+    struct vioblk_device * const vioblk =
+        (void*)io - offsetof(struct vioblk_device, io);
+
+    const struct ioseg * segs;
+    struct vioblk_queue * q;
+    struct vioblk_cursor cur;
+    struct ioseg seg;
+    uint64_t capacity;
+    uint32_t blk_size;
+    uint64_t sector;
+    uint32_t type;
+    long total;
+    long off;
+    int segcnt;
+    int pie;
+
+    trace("%s(pos=%lld, len=%ld, write=%d)", __func__,
+        ioreq->pos, ioreq->len, ioreq->write);
+
+    capacity = vioblk->conf->capacity;
+    blk_size = vioblk->conf->blk_size;
+
+    if (ioreq->segcnt != 0)
     {
-        // make sure we are not trying to read more than hard-drive capacity
-        if (sector > capacity)
+        segs = ioreq->segs;
+        segcnt = ioreq->segcnt;
+    }
+    else
+    {
+        seg.buf = ioreq->buf;
+        seg.len = ioreq->len;
+        segs = &seg;
+        segcnt = 1;
+    }
+
+    // every segment must hold whole blocks, so that requests split evenly
+
+    total = 0;
+
+    for (int i = 0; i < segcnt; i++)
+    {
+        if (segs[i].len <= 0 || segs[i].len % blk_size != 0)
         {
-            return -EACCESS;
+            return -EINVAL;
         }
 
-        memcpy(req.data, buf + write_bytes, blk_size);
-        request_block(vioblk, VIRTIO_BLK_T_OUT, sector, 0, 1);
-        write_bytes += blk_size;
+        total += segs[i].len;
+    }
+
+    if (total != ioreq->len || ioreq->pos % blk_size != 0)
+    {
+        return -EINVAL;
+    }
 
-        debug("sector=%lld", sector);
-        debug ("write_bytes=%lld", write_bytes);
+    sector = ioreq->pos / blk_size;
 
-        sector++;
+    if (sector + ioreq->len / blk_size > capacity)
+    {
+        return -EACCESS;
     }
 
-    __sync_synchronize();
-    lock_release(&vioblk->lock);
+    type = ioreq->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    ioreq->priv = 1;
+    cur.seg = segs;
+    cur.off = 0;
+
+    // the whole request goes on one queue, the next one in turn
+
+    pie = disable_interrupts();
+    q = &vioblk->queues[vioblk->next_q];
+    vioblk->next_q = (vioblk->next_q + 1) % vioblk->nq;
+    restore_interrupts(pie);
+
+    for (off = 0; off < ioreq->len; )
+    {
+        off += vioblk_start(vioblk, q, type, sector + off / blk_size,
+            &cur, ioreq->len - off, 1, ioreq, NULL);
+    }
+
+    vioblk_kick(vioblk, q);
+    pie = disable_interrupts();
+
+    if (--ioreq->priv == 0)
+    {
+        iocomplete(ioreq, (ioreq->result < 0) ? ioreq->result : ioreq->len);
+    }
+
+    restore_interrupts(pie);
 
-    return write_bytes;
+    return 0;
 }
 
 int vioblk_cntl(struct io * io, int cmd, void * arg)
@@ -443,6 +785,15 @@ int vioblk_cntl(struct io * io, int cmd, void * arg)
         *szarg = vioblk->conf->capacity * vioblk->conf->blk_size;
         result = 0;
         break;
+    case IOCTL_DISCARD:
+        result = vioblk_range(vioblk, VIRTIO_BLK_T_DISCARD, arg);
+        break;
+    case IOCTL_WRZEROES:
+        result = vioblk_range(vioblk, VIRTIO_BLK_T_WRITE_ZEROES, arg);
+        break;
+    case IOCTL_FLUSH:
+        result = vioblk_flush(vioblk);
+        break;
     default:
         result = -ENOTSUP;
     }
@@ -454,45 +805,446 @@ void vioblk_isr(int srcno, void * aux)
 {
     struct vioblk_device * vioblk = aux;
 
-    while (vioblk->virtq.last_seen != vioblk->virtq.used.idx)
-    {
-        vioblk->virtq.last_seen++;
-    }
+    // acknowledge first, so that a completion arriving while the rings are
+    // being drained raises a new interrupt
 
     vioblk->regs->interrupt_ack = vioblk->regs->interrupt_status;
     __sync_synchronize();
+
+    // the device has one interrupt for all its queues
+
+    for (int q = 0; q < vioblk->nq; q++)
+    {
+        vioblk_service(vioblk, &vioblk->queues[q]);
+    }
+
     condition_broadcast(&vioblk->ready);
 }
 
-// chain 3 descriptors
-// TODO: Figure out why condition waiting breaks everything
-// also implementing multiple virtqueues and larger chains
+// Drains the used ring of queue _q_, matching each completion to its request
+// by the chain's head descriptor. Called from vioblk_isr().
+
+void vioblk_service(struct vioblk_device * vioblk, struct vioblk_queue * q)
+{
+    struct virtq_used_elem * elem;
+    struct vioblk_request * req;
+    struct ioreq * ioreq;
+    uint16_t defer;
+
+    for (;;)
+    {
+        while (q->last_seen != q->virtq->used.idx)
+        {
+            __sync_synchronize();
+            elem = &q->virtq->used.ring[q->last_seen % vioblk->qlen];
+            req = &vioblk->reqs[q->head_req[elem->id]];
+            q->last_seen++;
+            q->inflight--;
+
+            // the thread in vioblk_finish() takes it from here
+
+            if (req->ioreq == NULL)
+            {
+                req->done = 1;
+                continue;
+            }
+
+            // part of an asynchronous request, which nobody waits on here
+
+            ioreq = req->ioreq;
+
+            if (req->status != VIRTIO_BLK_S_OK)
+            {
+                ioreq->result = -EIO;
+            }
+            else if (!req->direct && req->type == VIRTIO_BLK_T_IN)
+            {
+                memcpy(req->buf, req->bounce, req->len);
+            }
+
+            vioblk_release(vioblk, req);
+
+            if (--ioreq->priv == 0)
+            {
+                iocomplete(ioreq,
+                    (ioreq->result < 0) ? ioreq->result : ioreq->len);
+            }
+        }
+
+        if (!vioblk->event_idx)
+        {
+            break;
+        }
+
+        // ask for the next interrupt once defer + 1 more requests complete,
+        // then look again in case they already have
 
-int request_block (
+        defer = q->inflight / VIOBLK_INTR_COALESCE;
+        *virtq_used_event(&q->virtq->avail, vioblk->qlen) =
+            q->last_seen + defer;
+        __sync_synchronize();
+
+        if ((uint16_t)(q->virtq->used.idx - q->last_seen) <= defer)
+        {
+            break;
+        }
+    }
+}
+
+// Reads or writes the _len_ bytes held by _segs_ at _sector_ as a series of
+// requests. As many of them as there are free requests are put in flight
+// together before waiting for any. Returns the number of bytes transferred or
+// the first error.
+
+long vioblk_transfer (
+        struct vioblk_device * vioblk,
+        uint32_t type,
+        uint64_t sector,
+        const struct ioseg * segs,
+        long len)
+{
+    struct vioblk_request * reqs[VIOBLK_REQ_MAX];
+    struct vioblk_queue * q;
+    struct vioblk_cursor cur;
+    uint32_t blk_size;
+    long done;
+    long off;
+    uint32_t cnt;
+    int result;
+    int n;
+
+    blk_size = vioblk->conf->blk_size;
+    q = vioblk_thread_queue(vioblk);
+    cur.seg = segs;
+    cur.off = 0;
+    done = 0;
+
+    while (done < len)
+    {
+        off = done;
+
+        // only the first request of a batch may wait for the pool, so that a
+        // thread holding some requests never waits for more
+
+        for (n = 0; n < VIOBLK_REQ_MAX && off < len; n++)
+        {
+            cnt = vioblk_start(vioblk, q, type, sector + off / blk_size,
+                &cur, len - off, n == 0, NULL, &reqs[n]);
+
+            if (cnt == 0)
+            {
+                break;
+            }
+
+            off += cnt;
+        }
+
+        vioblk_kick(vioblk, q);
+        debug("sector=%lld requests=%d", sector + done / blk_size, n);
+        result = 0;
+
+        for (int i = 0; i < n; i++)
+        {
+            // the request may be reused as soon as it is finished
+
+            cnt = reqs[i]->len;
+
+            if (vioblk_finish(vioblk, reqs[i]) < 0 && result == 0)
+            {
+                result = -EIO;
+            }
+
+            done += cnt;
+        }
+
+        if (result < 0)
+        {
+            return result;
+        }
+    }
+
+    return done;
+}
+
+// Discards or zeroes (according to _type_) the sectors of _range_, which must
+// be whole blocks, with as many requests as the device's limit on sectors per
+// request calls for. Returns 0, -ENOTSUP if the device does not support the
+// request type, or another negative error.
+
+int vioblk_range (
+        struct vioblk_device * vioblk,
+        uint32_t type,
+        const struct iorange * range)
+{
+    struct vioblk_request * req;
+    struct vioblk_queue * q;
+    struct vioblk_cursor cur;
+    struct vioblk_range data;
+    struct ioseg seg;
+    uint32_t blk_size;
+    uint64_t sector;
+    uint64_t nsect;
+    uint32_t max;
+
+    trace("%s(type=%u, pos=%lld, len=%lld)", __func__,
+        type, range->pos, range->len);
+
+    blk_size = vioblk->conf->blk_size;
+    max = (type == VIRTIO_BLK_T_DISCARD) ?
+        vioblk->discard_max : vioblk->wrzeroes_max;
+
+    if (max == 0)
+    {
+        return -ENOTSUP;
+    }
+
+    if (range->pos % blk_size != 0 || range->len % blk_size != 0)
+    {
+        return -EINVAL;
+    }
+
+    sector = range->pos / VIRTIO_BLK_REQ_SECTOR_SIZE;
+    nsect = range->len / VIRTIO_BLK_REQ_SECTOR_SIZE;
+    q = vioblk_thread_queue(vioblk);
+
+    if (sector + nsect > vioblk->conf->capacity)
+    {
+        return -EACCESS;
+    }
+
+    while (nsect != 0)
+    {
+        data.sector = sector;
+        data.num_sectors = (nsect < max) ? nsect : max;
+        data.flags = 0;
+
+        seg.buf = &data;
+        seg.len = sizeof(data);
+        cur.seg = &seg;
+        cur.off = 0;
+
+        vioblk_start(vioblk, q, type, 0, &cur, sizeof(data), 1, NULL, &req);
+        vioblk_kick(vioblk, q);
+
+        if (vioblk_finish(vioblk, req) < 0)
+        {
+            return -EIO;
+        }
+
+        sector += data.num_sectors;
+        nsect -= data.num_sectors;
+    }
+
+    return 0;
+}
+
+// Sends the device a flush request, which completes once every write it has
+// completed so far is on stable storage. Without VIRTIO_BLK_F_FLUSH the device
+// writes through, so there is nothing to do. Returns 0 or -EIO.
+
+int vioblk_flush(struct vioblk_device * vioblk)
+{
+    struct vioblk_request * req;
+    struct vioblk_queue * q;
+    struct vioblk_cursor cur;
+    struct ioseg seg;
+
+    trace("%s()", __func__);
+
+    if (!vioblk->flush)
+    {
+        return 0;
+    }
+
+    // a flush carries no data, just the header and status
+
+    seg.buf = NULL;
+    seg.len = 0;
+    cur.seg = &seg;
+    cur.off = 0;
+
+    q = vioblk_thread_queue(vioblk);
+    vioblk_start(vioblk, q, VIRTIO_BLK_T_FLUSH, 0, &cur, 0, 1, NULL, &req);
+    vioblk_kick(vioblk, q);
+
+    return vioblk_finish(vioblk, req);
+}
+
+// Returns the queue for synchronous requests made by the running thread.
+
+struct vioblk_queue * vioblk_thread_queue(struct vioblk_device * vioblk)
+{
+    return &vioblk->queues[running_thread() % vioblk->nq];
+}
+
+// Returns nonzero if the device can reach _seg_ at its address, which holds
+// for memory in the identity-mapped RAM region but not for user buffers.
+
+int vioblk_dmaable(const struct ioseg * seg)
+{
+    return (RAM_START <= seg->buf && seg->buf + seg->len <= RAM_END);
+}
+
+// Starts a request for as much of the data at _cur_, of which _rem_ bytes are
+// left, as fits in one: at most xfer_max bytes in at most seg_cnt data
+// descriptors of at most seg_size bytes. If the data is in RAM, the data
+// descriptors point straight at it and may span several segments. Otherwise
+// the request covers part of one segment, which goes through the request's
+// bounce buffer. The request is taken from the pool along with descriptors of
+// queue _q_, filled in (header, data, status) and made available on _q_, and
+// _cur_ is advanced past its data. If the pool or the free list is
+// exhausted, sleeps until a request is freed when _wait_ is set and returns 0
+// otherwise. Returns the number of bytes in the request and stores it in
+// _reqptr_, unless it is part of _ioreq_, in which case it is counted in the
+// priv member of _ioreq_ and finished by vioblk_isr().
+
+uint32_t vioblk_start (
         struct vioblk_device * vioblk,
+        struct vioblk_queue * q,
         uint32_t type,
         uint64_t sector,
-        uint32_t queue,
-        uint32_t queue_max)
+        struct vioblk_cursor * cur,
+        long rem,
+        int wait,
+        struct ioreq * ioreq,
+        struct vioblk_request ** reqptr)
 {
-    uint32_t head, data, status;
-    uint16_t avail_idx;
+    struct virtq_desc * desc = q->virtq->desc;
+    struct vioblk_request * req;
+    const struct ioseg * seg;
+    uint32_t ndata;
+    uint32_t len;
+    uint32_t piece;
+    uint32_t off;
+    uint16_t idx;
+    uint16_t prev;
     uint16_t write_flag;
-    // int pie
+    int direct;
+    int pie;
+    int i;
 
-    // specify read or write location
+    // work out the data of the request before taking anything
+
+    seg = cur->seg;
+    off = cur->off;
+    len = 0;
+    ndata = 0;
+
+    while (len < rem && ndata < vioblk->seg_cnt && vioblk_dmaable(seg))
+    {
+        piece = seg->len - off;
 
-    req.type = type;
-    req.sector = sector;
+        if (piece > vioblk->seg_size)
+        {
+            piece = vioblk->seg_size;
+        }
 
-    // setup header descriptor
+        if (piece > vioblk->xfer_max - len)
+        {
+            piece = vioblk->xfer_max - len;
+        }
 
-    head = 0;
-    vioblk->virtq.desc_table[head].addr = (uint64_t)&req;
-    vioblk->virtq.desc_table[head].len = VIRTIO_BLK_REQ_HEADER_SIZE;
-    vioblk->virtq.desc_table[head].flags = VIRTQ_DESC_F_NEXT;
+        if (piece == 0)
+        {
+            break;
+        }
 
-    // make the descriptor writeable if trying to read
+        len += piece;
+        ndata++;
+        off += piece;
+
+        if (off == seg->len)
+        {
+            seg++;
+            off = 0;
+        }
+    }
+
+    direct = (ndata != 0);
+
+    if (!direct)
+    {
+        len = cur->seg->len - cur->off;
+
+        if (len > vioblk->xfer_max)
+        {
+            len = vioblk->xfer_max;
+        }
+
+        ndata = (len + vioblk->seg_size - 1) / vioblk->seg_size;
+    }
+
+    pie = disable_interrupts();
+
+    for (;;)
+    {
+        req = NULL;
+
+        for (i = 0; i < VIOBLK_REQ_MAX; i++)
+        {
+            if (!vioblk->reqs[i].busy)
+            {
+                req = &vioblk->reqs[i];
+                break;
+            }
+        }
+
+        if (req != NULL && ndata + 2 <= q->desc_nfree)
+        {
+            break;
+        }
+
+        if (!wait)
+        {
+            restore_interrupts(pie);
+            return 0;
+        }
+
+        // freeing a request broadcasts ready, which needs the requests made
+        // available so far to reach the device
+
+        for (i = 0; i < vioblk->nq; i++)
+        {
+            vioblk_kick(vioblk, &vioblk->queues[i]);
+        }
+
+        condition_wait(&vioblk->ready);
+    }
+
+    req->busy = 1;
+    req->done = 0;
+    req->type = type;
+    req->reserved = 0;
+    req->sector = sector;
+    req->status = VIRTIO_BLK_S_IOERR;
+    req->len = len;
+    req->ndesc = ndata + 2;
+    req->qidx = q - vioblk->queues;
+    req->direct = direct;
+    req->ioreq = ioreq;
+    req->buf = cur->seg->buf + cur->off;
+
+    if (ioreq != NULL)
+    {
+        ioreq->priv++;
+    }
+    else
+    {
+        *reqptr = req;
+    }
+
+    // the request is ours now, so copying need not hold off interrupts
+
+    restore_interrupts(pie);
+
+    if (!direct && type != VIRTIO_BLK_T_IN)
+    {
+        memcpy(req->bounce, req->buf, len);
+    }
+
+    pie = disable_interrupts();
+
+    // make the data descriptors writeable if trying to read
     if (type == VIRTIO_BLK_T_IN)
     {
         write_flag = VIRTQ_DESC_F_WRITE;
@@ -502,50 +1254,166 @@ int request_block (
         write_flag = 0;
     }
 
-    // setup data descriptor
+    // take the chain off the free list, header first
 
-    data = 1;
-    vioblk->virtq.desc_table[data].addr = (uint64_t)req.data;
-    vioblk->virtq.desc_table[data].len = VIRTIO_BLK_REQ_SECTOR_SIZE;
-    vioblk->virtq.desc_table[data].flags = write_flag | VIRTQ_DESC_F_NEXT;
+    req->head = q->desc_free;
+    idx = req->head;
+    prev = idx;
+    desc[idx].addr = (uint64_t)req;
+    desc[idx].len = VIRTIO_BLK_REQ_HEADER_SIZE;
+    desc[idx].flags = VIRTQ_DESC_F_NEXT;
 
-    // setup status descriptor
+    for (off = 0; off < len; off += piece)
+    {
+        idx = desc[prev].next;
+
+        if (direct)
+        {
+            piece = cur->seg->len - cur->off;
 
-    status = 2;
-    vioblk->virtq.desc_table[status].addr = (uint64_t)&req.status;
-    vioblk->virtq.desc_table[status].len = VIRTIO_BLK_REQ_FOOTER_SIZE;
-    vioblk->virtq.desc_table[status].flags = VIRTQ_DESC_F_WRITE;
+            if (piece > vioblk->seg_size)
+            {
+                piece = vioblk->seg_size;
+            }
 
-    // link descriptors in a chain
+            if (piece > len - off)
+            {
+                piece = len - off;
+            }
 
-    vioblk->virtq.desc_table[head].next = data;
-    vioblk->virtq.desc_table[data].next = status;
-    vioblk->virtq.desc_table[status].next = 0;
+            desc[idx].addr = (uint64_t)(cur->seg->buf + cur->off);
+        }
+        else
+        {
+            piece = len - off;
 
-    // put descriptors into available ring buffer
+            if (piece > vioblk->seg_size)
+            {
+                piece = vioblk->seg_size;
+            }
 
-    avail_idx = vioblk->virtq.avail.idx % queue_max;
-    vioblk->virtq.avail.ring[avail_idx] = head;
-    __sync_synchronize();
-    vioblk->virtq.avail.idx++;
+            desc[idx].addr = (uint64_t)(req->bounce + off);
+        }
+
+        desc[idx].len = piece;
+        desc[idx].flags = write_flag | VIRTQ_DESC_F_NEXT;
+        prev = idx;
+
+        // advance the cursor, past the end of a segment onto the next one
+
+        cur->off += piece;
+
+        if (cur->off == cur->seg->len && off + piece < rem)
+        {
+            cur->seg++;
+            cur->off = 0;
+        }
+    }
+
+    idx = desc[prev].next;
+    desc[idx].addr = (uint64_t)&req->status;
+    desc[idx].len = VIRTIO_BLK_REQ_FOOTER_SIZE;
+    desc[idx].flags = VIRTQ_DESC_F_WRITE;
+
+    q->desc_free = desc[idx].next;
+    q->desc_nfree -= req->ndesc;
+    q->head_req[req->head] = req - vioblk->reqs;
+
+    // put the chain into the available ring buffer; the device is notified
+    // by vioblk_kick() once the whole batch is there
+
+    q->virtq->avail.ring[q->virtq->avail.idx % vioblk->qlen] = req->head;
     __sync_synchronize();
-    virtio_notify_avail(vioblk->regs, queue);
+    q->virtq->avail.idx++;
+    q->inflight++;
 
-    // wait until data is ready to read or has written
+    restore_interrupts(pie);
 
-    // pie = disable_interrupts();
-    while (vioblk->virtq.avail.idx != vioblk->virtq.used.idx)
+    return len;
+}
+
+// Sleeps until _req_ completes, copies the data of a bounced read to the
+// caller's buffer and returns the request and its descriptors to the pool.
+// Returns 0 or -EIO.
+
+int vioblk_finish (
+        struct vioblk_device * vioblk,
+        struct vioblk_request * req)
+{
+    int result;
+    int pie;
+
+    // interrupts stay disabled from the check to the wait, otherwise a
+    // completion arriving in between would be missed and the thread would
+    // sleep forever
+
+    pie = disable_interrupts();
+
+    while (!req->done)
     {
-        //condition_wait(&vioblk->ready);
-        continue;
+        condition_wait(&vioblk->ready);
     }
-    // restore_interrupts(pie);
+
+    restore_interrupts(pie);
     __sync_synchronize();
 
-    if (req.status != VIRTIO_BLK_S_OK)
+    result = (req->status == VIRTIO_BLK_S_OK) ? 0 : -EIO;
+
+    if (result == 0 && !req->direct && req->type == VIRTIO_BLK_T_IN)
     {
-        return -EIO;
+        memcpy(req->buf, req->bounce, req->len);
     }
 
-    return 0;
+    pie = disable_interrupts();
+    vioblk_release(vioblk, req);
+    restore_interrupts(pie);
+
+    return result;
+}
+
+// Returns _req_ and its descriptors to the pool. Called with interrupts
+// disabled.
+
+void vioblk_release (
+        struct vioblk_device * vioblk,
+        struct vioblk_request * req)
+{
+    struct vioblk_queue * const q = &vioblk->queues[req->qidx];
+    struct virtq_desc * desc = q->virtq->desc;
+    uint16_t tail;
+
+    // the chain is still linked through next, so splice it back whole
+
+    tail = req->head;
+
+    for (int i = 1; i < req->ndesc; i++)
+    {
+        tail = desc[tail].next;
+    }
+
+    desc[tail].next = q->desc_free;
+    q->desc_free = req->head;
+    q->desc_nfree += req->ndesc;
+    req->busy = 0;
+
+    condition_broadcast(&vioblk->ready);
+}
+
+// Notifies the device of the requests made available on queue _q_ since the
+// last notification, if there are any and the device wants to hear about them.
+
+void vioblk_kick(struct vioblk_device * vioblk, struct vioblk_queue * q)
+{
+    int pie;
+
+    pie = disable_interrupts();
+
+    if (q->kick_idx != q->virtq->avail.idx)
+    {
+        virtio_kick_avail(vioblk->regs, q->qid, &q->virtq->avail,
+            &q->virtq->used, vioblk->qlen, q->kick_idx, vioblk->event_idx);
+        q->kick_idx = q->virtq->avail.idx;
+    }
+
+    restore_interrupts(pie);
 }
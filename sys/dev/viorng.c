@@ -32,9 +32,6 @@
 #define VIORNG_IRQ_PRIO 1
 #endif
 
-#define VIRTQ_USED_F_NO_NOTIFY      1
-#define VIRTQ_AVAIL_F_NO_INTERRUPT  1
-
 // INTERNAL TYPE DEFINITIONS
 //
 
@@ -74,6 +71,8 @@ struct viorng_device
     unsigned int bufcnt;
     char buf[VIORNG_BUFSZ];
 
+    int event_idx;  // VIRTIO_F_EVENT_IDX negotiated
+
     struct condition ready;
     struct lock lock;
 };
@@ -107,10 +106,12 @@ void viorng_attach(volatile struct virtio_mmio_regs * regs, int irqno)
     assert (regs->device_id == VIRTIO_ID_RNG);
     regs->status |= VIRTIO_STAT_DRIVER;
 
-    // negotiate features no mandatory features were specified
+    // negotiate features no mandatory features were specified, but event
+    // indices spare a notification when the device is still busy
 
     virtio_featset_init(needed_features);
     virtio_featset_init(wanted_features);
+    virtio_featset_add(wanted_features, VIRTIO_F_EVENT_IDX);
 
     result = virtio_negotiate_features(regs,
         enabled_features, wanted_features, needed_features);
@@ -131,6 +132,8 @@ void viorng_attach(volatile struct virtio_mmio_regs * regs, int irqno)
 
     viorng->regs = regs;
     viorng->irqno = irqno;
+    viorng->event_idx =
+        virtio_featset_test(enabled_features, VIRTIO_F_EVENT_IDX);
     condition_init(&viorng->ready, "viorng bytes ready");
     lock_init(&viorng->lock);
 
@@ -210,9 +213,8 @@ static long viorng_read(struct io * io, void * buf, long bufsz)
     long read_bytes;
     uint16_t avail_idx;
     uint16_t used_idx;
-    // int pie;
+    int pie;
 
-    lock_acquire(&viorng->lock);
     trace("%s(bufsz=%ld)",__func__,bufsz);
 
     if (bufsz < 0)
@@ -224,44 +226,49 @@ static long viorng_read(struct io * io, void * buf, long bufsz)
         bufsz = VIORNG_BUFSZ;
     }
 
+    lock_acquire(&viorng->lock);
     read_bytes = 0;
 
     // get random bytes from viorng
 
     while (read_bytes < bufsz)
     {
-        while (viorng->bufcnt > 0)
+        while (viorng->bufcnt > 0 && read_bytes < bufsz)
         {
             ((char*)buf)[read_bytes] =
                 viorng->buf[viorng->bufcnt - 1];
             read_bytes++;
             viorng->bufcnt--;
+        }
 
-            if (read_bytes >= bufsz)
-            {
-                return read_bytes;
-            }
+        if (read_bytes >= bufsz)
+        {
+            break;
         }
 
-        // request more random bytes from viorng
+        // request more random bytes from viorng, and ask for an interrupt
+        // once they are there
 
         avail_idx = viorng->virtq.avail.idx % 1; // queue_num
         viorng->virtq.avail.ring[avail_idx] = 0; // head
+        *virtq_used_event(&viorng->virtq.avail, 1) = viorng->virtq.used.idx;
+        __sync_synchronize();
         viorng->virtq.avail.idx++; // number of descriptors added
-        virtio_notify_avail(viorng->regs, 0);
+        virtio_kick_avail(viorng->regs, 0, &viorng->virtq.avail,
+            &viorng->virtq.used, 1, viorng->virtq.avail.idx - 1,
+            viorng->event_idx);
+
+        // wait for random bytes; interrupts stay disabled from the check to
+        // the wait so that the ISR's broadcast cannot be missed
 
-        // wait for random bytes
-        // OPTIONAL: create hash to store random numbers then pull when
-        // needed can also disable interrupts or something look at docs
+        pie = disable_interrupts();
 
-        // pie = disable_interrupts();
         while (viorng->virtq.avail.idx != viorng->virtq.used.idx)
         {
-            // condition_wait(&viorng->bytes_ready);
-            continue;
+            condition_wait(&viorng->ready);
         }
 
-        // restore_interrupts(pie);
+        restore_interrupts(pie);
         __sync_synchronize(); // fence_o,io
 
         used_idx = viorng->virtq.last_seen % 1;
@@ -35,6 +35,12 @@
 #define VIRTQ_INTR_USED             (1 << 0)
 #define VIRTQ_INTR_CONF             (1 << 1)
 
+// Ring flags used instead of the event indices when VIRTIO_F_EVENT_IDX is not
+// negotiated.
+
+#define VIRTQ_USED_F_NO_NOTIFY      1
+#define VIRTQ_AVAIL_F_NO_INTERRUPT  1
+
 #define VIRTIO_FEATLEN  4    // length of feature vector
 #define VIRTQ_DESC_SIZE 16
 
@@ -104,9 +110,10 @@ struct virtq_avail
 };
 
 // Evaluates to a compile-time constant giving the size of a virtq avail ring
-// sized for /n/ elements.
-
-#define VIRTQ_AVAIL_SIZE(n) (sizeof(struct virtq_avail)+(n)*sizeof(uint16_t))
+// sized for /n/ elements, including the used_event field that follows the
+// ring.
+#define VIRTQ_AVAIL_SIZE(n) \
+    (sizeof(struct virtq_avail)+((n)+1)*sizeof(uint16_t))
 
 struct virtq_used_elem
 {
@@ -122,10 +129,11 @@ struct virtq_used
 };
 
 // Evaluates to a compile-time constant giving the size of a virtq used ring
-// sized for /n/ elements.
-
+// sized for /n/ elements, including the avail_event field that follows the
+// ring.
 #define VIRTQ_USED_SIZE(n) \
-    (sizeof(struct virtq_used)+(n)*sizeof(struct virtq_used_elem))
+    (sizeof(struct virtq_used)+(n)*sizeof(struct virtq_used_elem) \
+        +sizeof(uint16_t))
 
 // EXPORTED FUNCTION DEFINITIONS
 //
@@ -144,6 +152,17 @@ extern int virtio_negotiate_features (
 static inline void virtio_notify_avail (
     volatile struct virtio_mmio_regs * regs, int qid);
 
+static inline volatile uint16_t * virtq_used_event (
+    struct virtq_avail * avail, uint_fast16_t len);
+static inline volatile uint16_t * virtq_avail_event (
+    const volatile struct virtq_used * used, uint_fast16_t len);
+static inline int virtq_need_event (
+    uint16_t event_idx, uint16_t new_idx, uint16_t old_idx);
+static inline void virtio_kick_avail (
+    volatile struct virtio_mmio_regs * regs, int qid,
+    const struct virtq_avail * avail, const volatile struct virtq_used * used,
+    uint_fast16_t len, uint16_t old_idx, int event_idx);
+
 extern void virtio_attach_virtq (
     volatile struct virtio_mmio_regs * regs, int qid, uint_fast16_t len,
     uint64_t desc_addr, uint64_t used_addr, uint64_t avail_addr);
@@ -224,6 +243,62 @@ static void virtio_notify_avail (
     regs->queue_notify = qid;
 }
 
+// With VIRTIO_F_EVENT_IDX, the driver stores the used ring index at which it
+// next wants an interrupt (used_event) after the avail ring, and the device
+// stores the avail ring index at which it next wants a notification
+// (avail_event) after the used ring. Both rings are /len/ entries long.
+
+static inline volatile uint16_t * virtq_used_event (
+    struct virtq_avail * avail, uint_fast16_t len)
+{
+    return &avail->ring[len];
+}
+
+static inline volatile uint16_t * virtq_avail_event (
+    const volatile struct virtq_used * used, uint_fast16_t len)
+{
+    return (volatile uint16_t *)&used->ring[len];
+}
+
+// Returns nonzero if moving a ring index from /old_idx/ to /new_idx/ passes
+// /event_idx/, the index the other side asked to be told about. This is
+// vring_need_event() from the specification; it handles wraparound.
+
+static inline int virtq_need_event (
+    uint16_t event_idx, uint16_t new_idx, uint16_t old_idx)
+{
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+// Notifies the device of the buffers added to the avail ring of queue /qid/
+// since its index was /old_idx/, unless the device has said it does not need
+// to be: through avail_event if /event_idx/ (VIRTIO_F_EVENT_IDX negotiated) is
+// set, or through VIRTQ_USED_F_NO_NOTIFY otherwise. Several buffers made
+// available together thus cost a single notification.
+
+static inline void virtio_kick_avail (
+    volatile struct virtio_mmio_regs * regs, int qid,
+    const struct virtq_avail * avail, const volatile struct virtq_used * used,
+    uint_fast16_t len, uint16_t old_idx, int event_idx)
+{
+    __sync_synchronize(); // the avail idx must be visible before the check
+
+    if (event_idx)
+    {
+        if (!virtq_need_event(*virtq_avail_event(used, len), avail->idx,
+            old_idx))
+        {
+            return;
+        }
+    }
+    else if (used->flags & VIRTQ_USED_F_NO_NOTIFY)
+    {
+        return;
+    }
+
+    virtio_notify_avail(regs, qid);
+}
+
 static inline void virtio_enable_virtq (
     volatile struct virtio_mmio_regs * regs, int qid)
 {
@@ -84,6 +84,14 @@ static int pipe_rbuf_full(const struct pipe * pipe);
 static void pipe_rbuf_putc(struct pipe * pipe, uint8_t c);
 static uint8_t pipe_rbuf_getc(struct pipe * pipe);
 
+static long iosubmit_seg(struct io * io, int write,
+    unsigned long long pos, void * buf, long len);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct condition ioreq_done; // broadcast by iocomplete()
+
 // EXPORTED FUNCTION DEFINITIONS
 //
 
@@ -248,6 +256,101 @@ long iowriteat (
     return io->intf->writeat(io, pos, buf, len);
 }
 
+int iosubmit(struct io * io, struct ioreq * req)
+{
+    unsigned long long pos;
+    long result;
+
+    assert (io != NULL);
+    assert (io->intf != NULL);
+    assert (req != NULL);
+
+    if (req->len < 0)
+    {
+        return -EINVAL;
+    }
+
+    req->done = 0;
+    req->result = 0;
+
+    if (io->intf->submit != NULL)
+    {
+        return io->intf->submit(io, req);
+    }
+
+    // no native support, so perform the request now
+
+    if ((req->write && io->intf->writeat == NULL) ||
+        (!req->write && io->intf->readat == NULL))
+    {
+        return -ENOTSUP;
+    }
+
+    if (req->segcnt == 0)
+    {
+        result = iosubmit_seg(io, req->write, req->pos, req->buf, req->len);
+    }
+    else
+    {
+        pos = req->pos;
+        result = 0;
+
+        for (int i = 0; i < req->segcnt && result >= 0; i++)
+        {
+            result = iosubmit_seg(io, req->write, pos,
+                req->segs[i].buf, req->segs[i].len);
+            pos += req->segs[i].len;
+        }
+
+        if (result >= 0)
+        {
+            result = req->len;
+        }
+    }
+
+    iocomplete(req, result);
+
+    return 0;
+}
+
+int iopoll(const struct ioreq * req)
+{
+    return req->done;
+}
+
+long iowait(struct ioreq * req)
+{
+    int pie;
+
+    // interrupts stay disabled from the check to the wait so that a completion
+    // signalled by an ISR in between is not missed
+
+    pie = disable_interrupts();
+
+    while (!req->done)
+    {
+        condition_wait(&ioreq_done);
+    }
+
+    restore_interrupts(pie);
+
+    return req->result;
+}
+
+void iocomplete(struct ioreq * req, long result)
+{
+    req->result = result;
+    __sync_synchronize();
+    req->done = 1;
+
+    if (req->callback != NULL)
+    {
+        req->callback(req);
+    }
+
+    condition_broadcast(&ioreq_done);
+}
+
 int ioctl(struct io * io, int cmd, void * arg)
 {
     assert (io != NULL);
@@ -358,6 +461,22 @@ struct io * create_seekable_io(struct io * io)
 // INTERNAL FUNCTION DEFINITIONS
 //
 
+// Performs one piece of a request for iosubmit() on an endpoint without
+// native support.
+
+long iosubmit_seg(struct io * io, int write,
+    unsigned long long pos, void * buf, long len)
+{
+    if (write)
+    {
+        return io->intf->writeat(io, pos, buf, len);
+    }
+    else
+    {
+        return io->intf->readat(io, pos, buf, len);
+    }
+}
+
 long memio_readat (
     struct io * io,
     unsigned long long pos,
@@ -466,8 +585,9 @@ int memio_cntl(struct io * io, int cmd, void * arg)
             mio->size = *szarg;
             result = 0;
         }
+        break;
     default:
-        result = -EINVAL;
+        result = -ENOTSUP;
     }
 
     return result;
@@ -19,6 +19,65 @@ struct io; // opaque (defined in ioimpl.h)
 #define IOCTL_SETEND    3 // arg is const unsigned long long *
 #define IOCTL_GETPOS    4 // arg is unsigned long long *
 #define IOCTL_SETPOS    5 // arg is const unsigned long long *
+#define IOCTL_GETCACHESZ 6 // arg is unsigned long long *
+#define IOCTL_SETCACHESZ 7 // arg is const unsigned long long *
+#define IOCTL_GETCACHEPOLICY 8 // arg is unsigned long long *
+#define IOCTL_SETCACHEPOLICY 9 // arg is const unsigned long long *
+#define IOCTL_GETCACHESTATS 10 // arg is struct cache_stats *
+#define IOCTL_DISCARD   11 // arg is const struct iorange *
+#define IOCTL_WRZEROES  12 // arg is const struct iorange *
+#define IOCTL_FLUSH     13 // arg is ignored
+#define IOCTL_GETFRAGSTATS 14 // arg is struct ktfs_frag_stats *
+
+// IOCTL_FLUSH returns once every write that completed before it was issued is
+// on stable storage, so it can be used to order later writes after earlier
+// ones. A device without a volatile write cache returns 0 at once.
+
+// A byte range of a block device, for IOCTL_DISCARD and IOCTL_WRZEROES. Both
+// must be multiples of the block size. IOCTL_DISCARD tells the device that the
+// range no longer holds data it needs to keep, and IOCTL_WRZEROES makes it
+// read back as zeroes without transferring a buffer of them. Devices that
+// cannot do either return -ENOTSUP.
+
+struct iorange
+{
+    unsigned long long pos;
+    unsigned long long len;
+};
+
+// A piece of a scattered buffer.
+
+struct ioseg
+{
+    void * buf;
+    long len;
+};
+
+// An asynchronous request to read or write _len_ bytes at _pos_, submitted
+// with iosubmit(). The data is in _buf_, or if _segcnt_ is nonzero, in the
+// _segcnt_ segments at _segs_ in turn, whose lengths add up to _len_ and
+// should be multiples of the endpoint's block size. The buffers must be
+// kernel memory and stay valid until the request completes; the segment list
+// need only last until iosubmit() returns. On completion _result_ holds the
+// number of bytes transferred or a negative error, _done_ is set and
+// _callback_, if not NULL, is called. The callback may run in an interrupt
+// service routine, so it must not sleep or acquire locks.
+
+struct ioreq
+{
+    unsigned long long pos;
+    void * buf;
+    long len;
+    const struct ioseg * segs;
+    int segcnt;
+    int write;          // nonzero to write the data, zero to read into it
+    void (*callback)(struct ioreq * req);
+    void * aux;         // for use by the callback
+
+    volatile int done;
+    long result;
+    unsigned long priv; // for use by the endpoint
+};
 
 // EXPORTED FUNCTION DECLARATIONS
 //
@@ -65,6 +124,17 @@ extern long iowriteat (
     long len
 );
 
+// The iosubmit() function starts _req_ on _io_ and returns 0, or returns a
+// negative error if the request was not accepted, in which case it never
+// completes. An endpoint without native support for asynchronous requests
+// performs the request with readat or writeat before iosubmit() returns.
+// The iopoll() function returns nonzero once _req_ has completed, and iowait()
+// sleeps until it has and returns its result.
+
+extern int iosubmit(struct io * io, struct ioreq * req);
+extern int iopoll(const struct ioreq * req);
+extern long iowait(struct ioreq * req);
+
 extern int ioseek (
     struct io * io,
     unsigned long long pos
@@ -50,6 +50,10 @@ struct iointf
         const void * buf,
         long len
     );
+    int (*submit) (
+        struct io * io,
+        struct ioreq * req
+    );
 };
 
 // EXPORTED FUNCTION DECLARATIONS
@@ -64,4 +68,10 @@ struct iointf
 extern struct io * ioinit0(struct io * io, const struct iointf * intf);
 extern struct io * ioinit1(struct io * io, const struct iointf * intf);
 
+// The iocomplete() function is called by an endpoint's submit implementation,
+// possibly from an ISR, when request _req_ finishes with _result_. It records
+// the result, calls the request's callback and wakes any thread in iowait().
+
+extern void iocomplete(struct ioreq * req, long result);
+
 #endif // _IOIMPL_H_
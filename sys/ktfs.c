@@ -22,35 +22,106 @@
 #include "string.h"
 #include "console.h"
 #include "cache.h"
+#include "blkq.h"
 #include "io.h"
 #include "dev/virtio.h"
+#include "conf.h"
 
 // INTERNAL CONSTANT DEFINITIONS
 //
 
+// Number of device ranges ktfs_transfer() hands to the cache at a time
+
+#define KTFS_IOV_MAX 16
+
 #define KTFS_FILE_IN_USE    (1 << 0)
 #define KTFS_FILE_FREE      (0 << 0)
 
+#define KTFS_DIR_NIL UINT32_MAX // end of directory hash chain
+
+#define KTFS_ITABLE_SIZE 16 // buckets in the in-core inode table
+
+#define KTFS_PTRS_PER_BLK (KTFS_BLKSZ / KTFS_DATA_BLOCK_PTR_SIZE)
+
+// Slots of an in-core inode's block map, one per level of pointer block
+
+#define KTFS_MAP_IND    0 // the indirect block
+#define KTFS_MAP_DIND   1 // a top-level doubly-indirect block
+#define KTFS_MAP_LEAF   2 // a block of pointers under a doubly-indirect one
+#define KTFS_MAP_SLOTS  3
+
+#define KTFS_MAP_NONE UINT32_MAX // empty block map slot
+
 // INTERNAL TYPE DEFINITIONS
 //
 
-uint32_t ktfs_get_new_block();
+int ktfs_get_new_block(uint32_t * block_id);
 int ktfs_release_block(uint32_t block_id);
 int ktfs_get_new_inode(uint16_t * inode_num);
 int ktfs_release_inode(uint16_t inode_id);
 long ktfs_writeat(struct io* io, unsigned long long pos, const void * buf, long len);
 
+// The root directory is kept in memory from mount on. Entry i of _dir_ is the
+// i-th dentry of the directory file, and the entries are also chained into
+// hash buckets by name, so a name is found without scanning or device I/O.
+// There can be no more entries than inodes, which bounds the table.
+
+// The block bitmap is also kept in memory, as 64-bit words so that it can be
+// searched a word at a time. Allocation is next-fit: a search starts where the
+// previous allocation ended. Changes are written through to the cache.
+
 struct file_system
 {
     struct ktfs_superblock superblock;
     uint8_t * inode_bitmap;
+
+    uint64_t * blk_bitmap;
+    uint32_t blk_cnt;       // number of data blocks
+    uint32_t blk_cursor;    // where the next search starts
+
+    struct ktfs_icore * root; // root directory, held from mount on
+
+    struct ktfs_dir_entry * dir;
+    uint32_t * dir_next;    // next entry in the same bucket
+    uint32_t * dir_heads;   // first entry of each bucket
+    uint32_t dir_cnt;
+    uint32_t dir_cap;
+    uint32_t dir_mask;      // number of buckets - 1
+};
+
+// An in-core inode holds the inode of an open file. All opens of the same
+// file share one, so a change of size made through any of them is seen by the
+// others. It is written back to the cache only if it changed, when the file
+// system is flushed or when the last reference to it is dropped.
+//
+// The inode also keeps a copy of the last pointer block it used at each level
+// of indirection, so a sequential scan reads each pointer block once instead
+// of once per data block it points at. Pointers are written through to the
+// cache as they change.
+
+struct ktfs_mapblk
+{
+    uint32_t blkid; // pointer block held, or KTFS_MAP_NONE
+    uint32_t ptrs[KTFS_PTRS_PER_BLK];
+};
+
+struct ktfs_icore
+{
+    struct ktfs_inode dinode;
+    uint16_t inum;
+    int dirty;
+    int refcnt;
+
+    struct ktfs_mapblk map[KTFS_MAP_SLOTS];
+
+    struct ktfs_icore * next; // next inode in the same bucket
 };
 
 struct ktfs_file
 {
     struct io io;
     struct ktfs_dir_entry entry;
-    size_t file_size;
+    struct ktfs_icore * ip;
     int in_use;
 
     struct ktfs_file * next;
@@ -66,6 +137,15 @@ struct ktfs_file * open_files;
 
 static struct cache * cache;
 
+static struct ktfs_icore * itable[KTFS_ITABLE_SIZE]; // in-core inodes by number
+
+// Blocks freed since the last discard, as a run of consecutive block ids.
+// The run is discarded on the device once it cannot grow any further, before
+// any block is allocated, and at the end of ktfs_delete().
+
+static uint32_t discard_start;
+static uint32_t discard_cnt;
+
 // INTERNAL FUNCTION DECLARATIONS
 //
 
@@ -86,19 +166,26 @@ long ktfs_writeat (
 static int ktfs_cntl(struct io *io, int cmd, void *arg);
 static int ktfs_flush(void);
 
-unsigned int ktfs_get_new_block();
+int ktfs_get_new_block(uint32_t * block_id);
 int ktfs_release_block(uint32_t block_id);
 int ktfs_get_new_inode(uint16_t * inode_num);
 int ktfs_release_inode(uint16_t inode_id);
 
+static uint64_t ktfs_bmap(struct ktfs_icore * ip, uint32_t dblock_id);
+static long ktfs_transfer (
+        struct ktfs_icore * ip,
+        unsigned long long pos,
+        void * buf,
+        long len,
+        int write);
 static int read_data_blockat(
-        struct ktfs_inode * inode,
+        struct ktfs_icore * ip,
         uint32_t dblock_id,
         uint32_t dblock_offset,
         void * buf,
         long len);
 static int write_data_blockat(
-        struct ktfs_inode * inode,
+        struct ktfs_icore * ip,
         uint32_t dblock_id,
         uint32_t dblock_offset,
         const void * buf,
@@ -107,6 +194,44 @@ static int write_data_blockat(
 static int set_inode_bitmap(int inode_num);
 static int init_inode_bitmap();
 
+static int init_block_bitmap(void);
+static int ktfs_ctz64(uint64_t x);
+static uint32_t ktfs_bitmap_find(uint32_t from, int used);
+static void ktfs_bitmap_sync(uint32_t first, uint32_t cnt);
+static void ktfs_bitmap_take(uint32_t first, uint32_t cnt);
+static int ktfs_alloc_blocks(uint32_t cnt, uint32_t * first);
+static int ktfs_alloc_run(uint32_t goal, uint32_t want, uint32_t * first);
+static void ktfs_frag_stats(
+        struct ktfs_icore * ip, struct ktfs_frag_stats * stats);
+
+static uint32_t ktfs_dir_hash(const char * name);
+static uint32_t ktfs_dir_lookup(const char * name);
+static void ktfs_dir_link(uint32_t slot);
+static void ktfs_dir_unlink(uint32_t slot);
+static int ktfs_dir_insert(const struct ktfs_dir_entry * dentry);
+static void ktfs_dir_remove(uint32_t slot);
+
+static struct ktfs_icore * ktfs_iget(uint16_t inum);
+static void ktfs_iput(struct ktfs_icore * ip);
+static void ktfs_iupdate(struct ktfs_icore * ip);
+
+static uint32_t * ktfs_map_get(
+        struct ktfs_icore * ip, int slot, uint32_t blkid);
+static void ktfs_map_init(struct ktfs_icore * ip, int slot, uint32_t blkid);
+static void ktfs_map_set (
+        struct ktfs_icore * ip,
+        int slot,
+        uint32_t blkid,
+        uint32_t idx,
+        uint32_t val);
+static void ktfs_map_drop(struct ktfs_icore * ip, uint32_t blkid);
+
+static void ktfs_ext_undo(struct ktfs_icore * ip, uint32_t start,
+        uint32_t end);
+
+static void ktfs_discard_flush(void);
+static int ktfs_zero_range(uint64_t pos, uint64_t len);
+
 
 // FUNCTION ALIASES
 //
@@ -144,28 +269,53 @@ int set_inode_bitmap(int inode_num)
     return 0;
 }
 
+// Marks the root directory's inode and the inode of each of its entries as in
+// use, and loads the entries into the in-memory directory, one directory block
+// at a time.
+
 int init_inode_bitmap()
 {
-    struct ktfs_inode root_inode;
-    struct ktfs_dir_entry dentry;
+    struct ktfs_icore * root;
+    struct ktfs_dir_entry dentries[KTFS_BLKSZ / KTFS_DENSZ];
     uint32_t root_dir_inode_blk_cnt;
-    uint32_t pos;
 
     uint32_t num_inodes_per_block;
     uint32_t num_inodes_in_use;
+    uint32_t nbuckets;
 
     num_inodes_per_block = KTFS_BLKSZ / KTFS_INOSZ;
 
     fs->inode_bitmap = kcalloc(1, (fs->superblock.inode_block_count * num_inodes_per_block / 8) + 1);
     set_inode_bitmap(fs->superblock.root_directory_inode);
 
-    pos = fs->superblock.root_directory_inode * KTFS_INOSZ;
-    pos += (1 + fs->superblock.bitmap_block_count) * KTFS_BLKSZ;
-    cache_readat(cache, pos, &root_inode, KTFS_INOSZ);
-    root_dir_inode_blk_cnt = root_inode.size / KTFS_BLKSZ;
-    num_inodes_in_use = root_inode.size / KTFS_DENSZ;
+    // one bucket per possible entry keeps the chains short
+
+    fs->dir_cap = fs->superblock.inode_block_count * num_inodes_per_block;
+    nbuckets = 1;
 
-    if (root_inode.size % KTFS_BLKSZ != 0)
+    while (nbuckets < fs->dir_cap)
+    {
+        nbuckets <<= 1;
+    }
+
+    fs->dir = kcalloc(fs->dir_cap, sizeof(struct ktfs_dir_entry));
+    fs->dir_next = kcalloc(fs->dir_cap, sizeof(uint32_t));
+    fs->dir_heads = kcalloc(nbuckets, sizeof(uint32_t));
+    fs->dir_mask = nbuckets - 1;
+    fs->dir_cnt = 0;
+
+    for (uint32_t i = 0; i < nbuckets; i++)
+    {
+        fs->dir_heads[i] = KTFS_DIR_NIL;
+    }
+
+    root = ktfs_iget(fs->superblock.root_directory_inode);
+    fs->root = root;
+
+    root_dir_inode_blk_cnt = root->dinode.size / KTFS_BLKSZ;
+    num_inodes_in_use = root->dinode.size / KTFS_DENSZ;
+
+    if (root->dinode.size % KTFS_BLKSZ != 0)
     {
         root_dir_inode_blk_cnt++;
     }
@@ -177,12 +327,14 @@ int init_inode_bitmap()
 
     for (int i = 0; i < root_dir_inode_blk_cnt; i++)
     {
+        read_data_blockat(root, i, 0, dentries, KTFS_BLKSZ);
+
         for (int j = 0; j < (KTFS_BLKSZ / KTFS_DENSZ); j++)
         {
             if (inode_cnt < num_inodes_in_use)
             {
-                read_data_blockat(&root_inode, i, j * KTFS_DENSZ, &dentry, KTFS_DENSZ);
-                set_inode_bitmap(dentry.inode);
+                set_inode_bitmap(dentries[j].inode);
+                ktfs_dir_insert(&dentries[j]);
                 inode_cnt++;
             }
             else
@@ -195,10 +347,115 @@ int init_inode_bitmap()
     return 0;
 }
 
+// FNV-1a hash of a file name, up to the longest name a dentry holds.
+
+uint32_t ktfs_dir_hash(const char * name)
+{
+    uint32_t h = 2166136261U;
+
+    for (int i = 0; i <= KTFS_MAX_FILENAME_LEN && name[i] != '\0'; i++)
+    {
+        h = (h ^ (uint8_t)name[i]) * 16777619U;
+    }
+
+    return h;
+}
+
+// Returns the directory slot of the entry named _name_, or KTFS_DIR_NIL if
+// there is none.
+
+uint32_t ktfs_dir_lookup(const char * name)
+{
+    uint32_t slot;
+
+    slot = fs->dir_heads[ktfs_dir_hash(name) & fs->dir_mask];
+
+    while (slot != KTFS_DIR_NIL)
+    {
+        if (strncmp(fs->dir[slot].name, name,
+            KTFS_MAX_FILENAME_LEN + sizeof(uint8_t)) == 0)
+        {
+            return slot;
+        }
+
+        slot = fs->dir_next[slot];
+    }
+
+    return KTFS_DIR_NIL;
+}
+
+void ktfs_dir_link(uint32_t slot)
+{
+    uint32_t * head;
+
+    head = &fs->dir_heads[ktfs_dir_hash(fs->dir[slot].name) & fs->dir_mask];
+    fs->dir_next[slot] = *head;
+    *head = slot;
+}
+
+void ktfs_dir_unlink(uint32_t slot)
+{
+    uint32_t * link;
+
+    link = &fs->dir_heads[ktfs_dir_hash(fs->dir[slot].name) & fs->dir_mask];
+
+    while (*link != KTFS_DIR_NIL)
+    {
+        if (*link == slot)
+        {
+            *link = fs->dir_next[slot];
+            return;
+        }
+
+        link = &fs->dir_next[*link];
+    }
+}
+
+// Appends _dentry_ to the in-memory directory, like the directory file it
+// goes at the end of. Returns its slot, or -ENOINODEBLKS if the directory is
+// full.
+
+int ktfs_dir_insert(const struct ktfs_dir_entry * dentry)
+{
+    uint32_t slot;
+
+    if (fs->dir_cnt == fs->dir_cap)
+    {
+        return -ENOINODEBLKS;
+    }
+
+    slot = fs->dir_cnt++;
+    fs->dir[slot] = *dentry;
+    ktfs_dir_link(slot);
+
+    return slot;
+}
+
+// Removes the entry in _slot_ from the in-memory directory. As in the
+// directory file, the last entry moves into its place.
+
+void ktfs_dir_remove(uint32_t slot)
+{
+    uint32_t last;
+
+    last = fs->dir_cnt - 1;
+    ktfs_dir_unlink(slot);
+
+    if (slot != last)
+    {
+        ktfs_dir_unlink(last);
+        fs->dir[slot] = fs->dir[last];
+        ktfs_dir_link(slot);
+    }
+
+    fs->dir_cnt--;
+}
+
 int ktfs_mount(struct io * io)
 {
     uint64_t read_bytes;
     char buf[512]; // FIXME: scary
+    int result;
 
     fs = kcalloc(1, sizeof(struct file_system));
     read_bytes = ioreadat(io, 0, &buf, 512);
@@ -209,9 +466,28 @@ int ktfs_mount(struct io * io)
         return read_bytes;
     }
 
-    backend = ioaddref(io);
-    create_cache(backend, &cache);
+    // requests from the cache go through a queue that merges neighbouring ones
+
+    backend = create_blkq_io(io);
+
+    if (backend == NULL)
+    {
+        backend = ioaddref(io);
+    }
+
+    result = create_cache(backend, CACHE_CAPACITY, CACHE_WRITEBACK, &cache);
+
+    if (result < 0)
+    {
+        ioclose(backend);
+        backend = NULL;
+        kfree(fs);
+        fs = NULL;
+        return result;
+    }
+
     init_inode_bitmap();
+    init_block_bitmap();
     open_files = NULL;
 
     return 0;
@@ -223,99 +499,501 @@ void insert_file_to_list(struct ktfs_file * fs_file)
     open_files = fs_file;
 }
 
+// Takes _fs_file_ off the list of open files and drops its reference to the
+// in-core inode. The file is marked free, but the struct itself stays, since
+// the handle may still be in use; ktfs_close() frees it.
+
+void remove_file_from_list(struct ktfs_file * fs_file)
+{
+    struct ktfs_file ** link = &open_files;
+
+    while (*link != NULL && *link != fs_file)
+    {
+        link = &(*link)->next;
+    }
+
+    if (*link == NULL)
+    {
+        return;
+    }
+
+    *link = fs_file->next;
+
+    ktfs_iput(fs_file->ip);
+    fs_file->ip = NULL;
+    fs_file->in_use = KTFS_FILE_FREE;
+}
+
+// Removes every open of the file _name_ from the list. All of them share one
+// in-core inode, so none may be left behind to write it back after the inode
+// has been released. The handles stay valid until they are closed, but any
+// I/O on them fails with -ENOENT.
+
 void delete_file_from_list(const char * name)
 {
     struct ktfs_file *curr = open_files;
-    struct ktfs_file *prev = NULL;
+    struct ktfs_file *next;
 
     while (curr != NULL)
     {
+        next = curr->next;
+
         if (strcmp(curr->entry.name, name) == 0)
         {
-            if(prev != NULL)
-            {
-                prev->next = curr->next;
-            }
-            else
-            {
-                open_files = curr->next;
-            }
+            remove_file_from_list(curr);
+        }
 
-            kfree(curr);
-            return;
+        curr = next;
+    }
+}
+
+// Returns the in-core inode for inode number _inum_ with one more reference
+// on it, reading the inode through the cache if no open file holds it yet.
+
+struct ktfs_icore * ktfs_iget(uint16_t inum)
+{
+    struct ktfs_icore ** bucket;
+    struct ktfs_icore * ip;
+    uint64_t pos;
+
+    bucket = &itable[inum % KTFS_ITABLE_SIZE];
+
+    for (ip = *bucket; ip != NULL; ip = ip->next)
+    {
+        if (ip->inum == inum)
+        {
+            ip->refcnt++;
+            return ip;
         }
-        else
+    }
+
+    ip = kcalloc(1, sizeof(struct ktfs_icore));
+    ip->inum = inum;
+    ip->refcnt = 1;
+
+    for (int i = 0; i < KTFS_MAP_SLOTS; i++)
+    {
+        ip->map[i].blkid = KTFS_MAP_NONE;
+    }
+
+    pos = inum * KTFS_INOSZ;
+    pos += (1 + fs->superblock.bitmap_block_count) * KTFS_BLKSZ;
+    cache_readat(cache, pos, &ip->dinode, KTFS_INOSZ);
+
+    ip->next = *bucket;
+    *bucket = ip;
+
+    return ip;
+}
+
+// Drops a reference to _ip_. The last one writes the inode back if it is
+// dirty and frees it.
+
+void ktfs_iput(struct ktfs_icore * ip)
+{
+    struct ktfs_icore ** link;
+
+    if (--ip->refcnt > 0)
+    {
+        return;
+    }
+
+    ktfs_iupdate(ip);
+
+    link = &itable[ip->inum % KTFS_ITABLE_SIZE];
+
+    while (*link != ip)
+    {
+        link = &(*link)->next;
+    }
+
+    *link = ip->next;
+    kfree(ip);
+}
+
+// Writes the in-core inode _ip_ to the cache if it changed since it was read
+// or last written.
+
+void ktfs_iupdate(struct ktfs_icore * ip)
+{
+    uint64_t pos;
+
+    if (!ip->dirty)
+    {
+        return;
+    }
+
+    pos = ip->inum * KTFS_INOSZ;
+    pos += (1 + fs->superblock.bitmap_block_count) * KTFS_BLKSZ;
+    cache_writeat(cache, pos, &ip->dinode, KTFS_INOSZ);
+
+    ip->dirty = 0;
+}
+
+// Returns the pointers held in pointer block _blkid_ of _ip_, reading the
+// block into slot _slot_ of its block map unless it is there already.
+
+uint32_t * ktfs_map_get(struct ktfs_icore * ip, int slot, uint32_t blkid)
+{
+    struct ktfs_mapblk * mb = &ip->map[slot];
+    uint64_t pos;
+
+    if (mb->blkid != blkid)
+    {
+        pos = 1 + fs->superblock.bitmap_block_count;
+        pos += fs->superblock.inode_block_count;
+        pos = (pos + blkid) * KTFS_BLKSZ;
+
+        cache_readat(cache, pos, mb->ptrs, KTFS_BLKSZ);
+        mb->blkid = blkid;
+    }
+
+    return mb->ptrs;
+}
+
+// Starts the newly allocated pointer block _blkid_ in slot _slot_ of the
+// block map of _ip_. The block is zeroed rather than read, since what it held
+// before is of no use.
+
+void ktfs_map_init(struct ktfs_icore * ip, int slot, uint32_t blkid)
+{
+    struct ktfs_mapblk * mb = &ip->map[slot];
+    uint64_t pos;
+
+    pos = 1 + fs->superblock.bitmap_block_count;
+    pos += fs->superblock.inode_block_count;
+    pos = (pos + blkid) * KTFS_BLKSZ;
+
+    memset(mb->ptrs, 0, KTFS_BLKSZ);
+    mb->blkid = blkid;
+
+    cache_writeat(cache, pos, mb->ptrs, KTFS_BLKSZ);
+}
+
+// Sets pointer _idx_ of pointer block _blkid_ of _ip_ to _val_, in the block
+// map and in the cache.
+
+void ktfs_map_set (
+        struct ktfs_icore * ip,
+        int slot,
+        uint32_t blkid,
+        uint32_t idx,
+        uint32_t val)
+{
+    uint64_t pos;
+
+    ktfs_map_get(ip, slot, blkid)[idx] = val;
+
+    pos = 1 + fs->superblock.bitmap_block_count;
+    pos += fs->superblock.inode_block_count;
+    pos = (pos + blkid) * KTFS_BLKSZ + idx * KTFS_DATA_BLOCK_PTR_SIZE;
+
+    cache_writeat(cache, pos, &val, KTFS_DATA_BLOCK_PTR_SIZE);
+}
+
+// Forgets pointer block _blkid_ of _ip_, which is being freed. A later user
+// of the block must not find its old pointers in the block map.
+
+void ktfs_map_drop(struct ktfs_icore * ip, uint32_t blkid)
+{
+    for (int i = 0; i < KTFS_MAP_SLOTS; i++)
+    {
+        if (ip->map[i].blkid == blkid)
         {
-            prev = curr;
-            curr = curr->next;
+            ip->map[i].blkid = KTFS_MAP_NONE;
         }
     }
 }
 
-uint32_t ktfs_get_new_block()
+// Reads the block bitmap into memory. Bits past the last data block are never
+// handed out, even if the on-disk bitmap has room for them.
+
+int init_block_bitmap(void)
 {
-    unsigned long long pos;
-    uint8_t byte;
+    uint32_t nbytes;
+    uint32_t ndata;
+
+    nbytes = fs->superblock.bitmap_block_count * KTFS_BLKSZ;
+    ndata = fs->superblock.block_count - 1;
+    ndata -= fs->superblock.bitmap_block_count;
+    ndata -= fs->superblock.inode_block_count;
+
+    fs->blk_cnt = (ndata < nbytes * 8) ? ndata : nbytes * 8;
+    fs->blk_cursor = 0;
+
+    fs->blk_bitmap = kmalloc(nbytes);
+    return cache_readat(cache, 1 * KTFS_BLKSZ, fs->blk_bitmap, nbytes);
+}
+
+// Returns the index of the lowest set bit of a non-zero _x_. Uses a de Bruijn
+// sequence, since the kernel is built without the bit manipulation extension
+// and without libgcc.
+
+int ktfs_ctz64(uint64_t x)
+{
+    static const uint8_t table[64] =
+    {
+         0,  1,  2, 53,  3,  7, 54, 27,  4, 38, 41,  8, 34, 55, 48, 28,
+        62,  5, 39, 46, 44, 42, 22,  9, 24, 35, 59, 56, 49, 18, 29, 11,
+        63, 52,  6, 26, 37, 40, 33, 47, 61, 45, 43, 21, 23, 58, 17, 10,
+        51, 25, 36, 32, 60, 20, 57, 16, 50, 31, 19, 15, 30, 14, 13, 12
+    };
+
+    return table[((x & -x) * 0x022FDD63CC95386DULL) >> 58];
+}
+
+// Returns the first block at or after _from_ that is in use if _used_ is
+// non-zero, or free otherwise. Returns fs->blk_cnt if there is none.
+
+uint32_t ktfs_bitmap_find(uint32_t from, int used)
+{
+    uint32_t nwords;
+    uint32_t bit;
+    uint64_t word;
 
-    for (uint32_t i = 0; i < fs->superblock.bitmap_block_count * KTFS_BLKSZ; i++)
+    nwords = (fs->blk_cnt + 63) / 64;
+
+    for (uint32_t i = from / 64; i < nwords; i++)
     {
-        // read 1 byte of bitmap a time
-        pos = 1 * KTFS_BLKSZ + i;
-        cache_readat(cache, pos, &byte, 1);
+        word = used ? fs->blk_bitmap[i] : ~fs->blk_bitmap[i];
 
-        for (uint32_t j = 0; j < 8; j++)
+        if (i == from / 64)
         {
-            if (((byte >> j) & 0x1) == 0)
+            word &= ~0ULL << (from % 64);
+        }
+
+        if (word != 0)
+        {
+            bit = i * 64 + ktfs_ctz64(word);
+            return (bit < fs->blk_cnt) ? bit : fs->blk_cnt;
+        }
+    }
+
+    return fs->blk_cnt;
+}
+
+// Writes the bytes of the in-memory bitmap holding blocks _first_ through
+// _first_ + _cnt_ - 1 to the cache.
+
+void ktfs_bitmap_sync(uint32_t first, uint32_t cnt)
+{
+    uint32_t lo = first / 8;
+    uint32_t hi = (first + cnt - 1) / 8;
+
+    cache_writeat(cache, 1 * KTFS_BLKSZ + lo,
+        (uint8_t *)fs->blk_bitmap + lo, hi - lo + 1);
+}
+
+// Marks the free blocks _first_ through _first_ + _cnt_ - 1 as in use and
+// moves the next-fit cursor past them.
+
+void ktfs_bitmap_take(uint32_t first, uint32_t cnt)
+{
+    // a block handed out again must not be discarded afterwards
+
+    ktfs_discard_flush();
+
+    for (uint32_t i = first; i < first + cnt; i++)
+    {
+        fs->blk_bitmap[i / 64] |= 1ULL << (i % 64);
+    }
+
+    ktfs_bitmap_sync(first, cnt);
+    fs->blk_cursor = first + cnt;
+}
+
+// Allocates _cnt_ consecutive free blocks and returns the first one in
+// _first_. The search starts at the next-fit cursor and wraps around once.
+// Each word is looked at a bounded number of times, since a search steps from
+// one free run to the next. Returns -ENODATABLKS if no run is long enough.
+
+int ktfs_alloc_blocks(uint32_t cnt, uint32_t * first)
+{
+    uint32_t start;
+    uint32_t end;
+    uint32_t limit;
+
+    if (cnt == 0)
+    {
+        return -EINVAL;
+    }
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        start = (pass == 0) ? fs->blk_cursor : 0;
+        limit = (pass == 0) ? fs->blk_cnt : fs->blk_cursor;
+
+        while (start < limit)
+        {
+            start = ktfs_bitmap_find(start, 0);
+
+            if (start >= limit)
             {
-                byte |=  (1 << j);
-                cache_writeat(cache, pos, &byte, 1);
+                break;
+            }
 
-                // return id of block
-                return (i * 8) + j;
+            end = ktfs_bitmap_find(start, 1);
+
+            if (end - start >= cnt)
+            {
+                ktfs_bitmap_take(start, cnt);
+                *first = start;
+                return 0;
             }
+
+            start = end;
         }
     }
 
-    return 0;
+    return -ENODATABLKS;
 }
 
+int ktfs_get_new_block(uint32_t * block_id)
+{
+    return ktfs_alloc_blocks(1, block_id);
+}
 
-int ktfs_release_block(uint32_t block_id)
+// Allocates a run of up to _want_ consecutive blocks for a file that grows and
+// returns the first one in _first_. If block _goal_, the one after the file's
+// current last block, is free, the run starts there so the file continues
+// without a break. Otherwise the whole of _want_ is taken in one run if there
+// is one, or failing that the longest run found by halving the request.
+// Returns the number of blocks allocated, or -ENODATABLKS if none are free.
+
+int ktfs_alloc_run(uint32_t goal, uint32_t want, uint32_t * first)
 {
-    uint32_t pos;
-    uint32_t byte_pos;
-    uint32_t bit_pos;
-    uint8_t byte;
+    uint32_t end;
+
+    if (goal < fs->blk_cnt && ktfs_bitmap_find(goal, 0) == goal)
+    {
+        end = ktfs_bitmap_find(goal, 1);
+
+        if (end - goal < want)
+        {
+            want = end - goal;
+        }
+
+        ktfs_bitmap_take(goal, want);
+        *first = goal;
+        return want;
+    }
+
+    while (want > 0)
+    {
+        if (ktfs_alloc_blocks(want, first) == 0)
+        {
+            return want;
+        }
+
+        want /= 2;
+    }
 
-    byte_pos = block_id / 8;
-    bit_pos = block_id % 8;
-    pos = byte_pos + 1 * KTFS_BLKSZ;
+    return -ENODATABLKS;
+}
 
-    cache_readat(cache, pos, &byte, 1);
+int ktfs_release_block(uint32_t block_id)
+{
+    fs->blk_bitmap[block_id / 64] &= ~(1ULL << (block_id % 64)); // clear
+    ktfs_bitmap_sync(block_id, 1);
 
-    byte = byte & ~(1 << bit_pos); // clear
+    // files are released from the last block down, so a run mostly grows
+    // downwards
 
-    cache_writeat(cache, pos, &byte, 1);
+    if (discard_cnt != 0 && block_id + 1 == discard_start)
+    {
+        discard_start--;
+        discard_cnt++;
+    }
+    else if (discard_cnt != 0 && discard_start + discard_cnt == block_id)
+    {
+        discard_cnt++;
+    }
+    else
+    {
+        ktfs_discard_flush();
+        discard_start = block_id;
+        discard_cnt = 1;
+    }
 
     return 0;
 }
 
-int release_data_block(struct ktfs_inode * inode, uint32_t dblock_id)
+// Discards the pending run of freed blocks on the device. The blocks are
+// dropped from the cache first, since a write-back of one would undo the
+// discard. Discarding is only a hint, so an error is not reported.
+
+void ktfs_discard_flush(void)
 {
-    uint64_t pos;
+    struct iorange range;
     uint64_t start_pos_dblock;
+
+    if (discard_cnt == 0)
+    {
+        return;
+    }
+
+    start_pos_dblock = 1 + fs->superblock.bitmap_block_count;
+    start_pos_dblock += fs->superblock.inode_block_count;
+
+    range.pos = (start_pos_dblock + discard_start) * KTFS_BLKSZ;
+    range.len = (uint64_t)discard_cnt * KTFS_BLKSZ;
+    discard_cnt = 0;
+
+    cache_invalidate(cache, range.pos, range.len);
+    ioctl(backend, IOCTL_DISCARD, &range);
+}
+
+// Makes the device range at _pos_ of _len_ bytes read back as zeroes. Uses
+// IOCTL_WRZEROES if the device supports it, and otherwise writes zeroes
+// through the cache.
+
+int ktfs_zero_range(uint64_t pos, uint64_t len)
+{
+    static const char zeroes[KTFS_BLKSZ];
+    struct iorange range;
+    int result;
+
+    range.pos = pos;
+    range.len = len;
+
+    // a dirty copy written back later would land on top of the zeroes
+
+    cache_invalidate(cache, pos, len);
+
+    if (ioctl(backend, IOCTL_WRZEROES, &range) == 0)
+    {
+        // read-ahead may have cached the old contents while the device was
+        // zeroing the range, so drop them once it is done
+
+        cache_invalidate(cache, pos, len);
+        return 0;
+    }
+
+    for (uint64_t off = 0; off < len; off += KTFS_BLKSZ)
+    {
+        result = cache_writeat(cache, pos + off, zeroes, KTFS_BLKSZ);
+
+        if (result < 0)
+        {
+            return result;
+        }
+    }
+
+    return 0;
+}
+
+int release_data_block(struct ktfs_icore * ip, uint32_t dblock_id)
+{
+    struct ktfs_inode * inode = &ip->dinode;
     uint32_t adj_dblock_id;
+    uint32_t * ptrs;
 
     uint32_t data_block_idx1;
-    uint32_t data_block_idx2;
     uint32_t dindirect_instance;
 
     uint32_t dindirect_offset1;
     uint32_t dindirect_offset2;
 
-    start_pos_dblock = 1 + fs->superblock.bitmap_block_count;
-    start_pos_dblock += fs->superblock.inode_block_count;
-
     // if the dblock_id is less than 3, then it is a direct block
     if (dblock_id < 3)
     {
@@ -325,19 +1003,19 @@ int release_data_block(struct ktfs_inode * inode, uint32_t dblock_id)
     // 128 is the number of data blocks for indirect reference.
     else if ((dblock_id - 3) < 128)
     {
-        // release inderct data block
+        // look up the pointer of the block I need in the indirect data block
+
+        ptrs = ktfs_map_get(ip, KTFS_MAP_IND, inode->indirect);
+        ktfs_release_block(ptrs[dblock_id - 3]);
+
+        // release inderct data block, now that it has been read (a freed
+        // block may be discarded)
         if (dblock_id == 3)
         {
+            ktfs_map_drop(ip, inode->indirect);
             ktfs_release_block (inode->indirect);
         }
 
-        // read the pointer of the block I need in the indirect data block
-
-        pos = (start_pos_dblock + inode->indirect) * KTFS_BLKSZ;
-        pos += (dblock_id - 3) * KTFS_DATA_BLOCK_PTR_SIZE;
-        cache_readat(cache, pos, &data_block_idx1, KTFS_DATA_BLOCK_PTR_SIZE);
-        ktfs_release_block(data_block_idx1);
-
         return 0;
     }
     else
@@ -363,27 +1041,29 @@ int release_data_block(struct ktfs_inode * inode, uint32_t dblock_id)
         dindirect_offset1 = adj_dblock_id / 128;
         dindirect_offset2 = adj_dblock_id % 128;
 
-        if (adj_dblock_id == 0)
-        {
-            ktfs_release_block(inode->dindirect[dindirect_instance]);
-        }
+        ptrs = ktfs_map_get(ip, KTFS_MAP_DIND,
+            inode->dindirect[dindirect_instance]);
+        data_block_idx1 = ptrs[dindirect_offset1];
+
+        ptrs = ktfs_map_get(ip, KTFS_MAP_LEAF, data_block_idx1);
+        ktfs_release_block(ptrs[dindirect_offset2]);
 
-        pos = (start_pos_dblock + inode->dindirect[dindirect_instance]) * KTFS_BLKSZ;
-        pos += dindirect_offset1 * KTFS_DATA_BLOCK_PTR_SIZE;
-        cache_readat(cache, pos, &data_block_idx1, KTFS_DATA_BLOCK_PTR_SIZE);
+        // the pointer blocks go after the pointers have been read out of them
 
         // if release the first (0th) entry of the second indirect block,
         // also release the second indirect data block
 
         if (dindirect_offset2 == 0)
         {
+            ktfs_map_drop(ip, data_block_idx1);
             ktfs_release_block(data_block_idx1);
         }
 
-        pos = (start_pos_dblock + data_block_idx1) * KTFS_BLKSZ;
-        pos += dindirect_offset2 * KTFS_DATA_BLOCK_PTR_SIZE;
-        cache_readat(cache, pos, &data_block_idx2, KTFS_DATA_BLOCK_PTR_SIZE);
-        ktfs_release_block(data_block_idx2);
+        if (adj_dblock_id == 0)
+        {
+            ktfs_map_drop(ip, inode->dindirect[dindirect_instance]);
+            ktfs_release_block(inode->dindirect[dindirect_instance]);
+        }
 
         return 0;
     }
@@ -433,49 +1113,34 @@ int ktfs_release_inode(uint16_t inode_id)
     return 0;
 }
 
-// Helper function for open and readat. It takes a provided data block id and
-// a offset and finds the proper data block and reads the data block up to len.
-// This function allows callers to treat the data_blocks as one contiguous block
-// allower the caller to not worry about offsets and entering indirect data
-// blocks to find blocks etc.
+// Helper function for the data block accessors. It takes a data block id of
+// an inode and returns the byte position of that block on the device,
+// following the indirect and doubly-indirect pointers through the cache. This
+// allows callers to treat the data blocks as one contiguous block without
+// worrying about entering indirect data blocks.
 
-int read_data_blockat (
-        struct ktfs_inode * inode,
-        uint32_t dblock_id,
-        uint32_t dblock_offset,
-        void * buf,
-        long len)
+uint64_t ktfs_bmap(struct ktfs_icore * ip, uint32_t dblock_id)
 {
-    uint64_t pos;
+    struct ktfs_inode * inode = &ip->dinode;
     uint64_t start_pos_dblock;
     uint32_t adj_dblock_id;
+    uint32_t * ptrs;
 
     uint32_t data_block_idx1;
-    uint32_t data_block_idx2;
     uint32_t dindirect_instance;
 
-    uint32_t dindirect_offset1;
-    uint32_t dindirect_offset2;
-
     start_pos_dblock = 1 + fs->superblock.bitmap_block_count;
     start_pos_dblock += fs->superblock.inode_block_count;
 
     if (dblock_id < 3)
     {
-        pos = (start_pos_dblock + inode->block[dblock_id]) * KTFS_BLKSZ;
-        pos += dblock_offset;
-        cache_readat(cache, pos, buf, len);
-        return 0;
+        return (start_pos_dblock + inode->block[dblock_id]) * KTFS_BLKSZ;
     }
     else if ((dblock_id - 3) < 128)
     {
-        pos = (start_pos_dblock + inode->indirect) * KTFS_BLKSZ;
-        pos += (dblock_id - 3) * KTFS_DATA_BLOCK_PTR_SIZE;
-        cache_readat(cache, pos, &data_block_idx1, KTFS_DATA_BLOCK_PTR_SIZE);
+        ptrs = ktfs_map_get(ip, KTFS_MAP_IND, inode->indirect);
 
-        pos = (start_pos_dblock + data_block_idx1) * KTFS_BLKSZ + dblock_offset;
-        cache_readat(cache, pos, buf, len);
-        return 0;
+        return (start_pos_dblock + ptrs[dblock_id - 3]) * KTFS_BLKSZ;
     }
     else
     {
@@ -490,95 +1155,153 @@ int read_data_blockat (
             adj_dblock_id = dblock_id - 131 - 128 * 128;
         }
 
-        dindirect_offset1 = adj_dblock_id / 128;
-        pos = (start_pos_dblock + inode->dindirect[dindirect_instance]) * KTFS_BLKSZ;
-        pos += dindirect_offset1 * KTFS_DATA_BLOCK_PTR_SIZE;
-        cache_readat(cache, pos, &data_block_idx1, KTFS_DATA_BLOCK_PTR_SIZE);
-
-        dindirect_offset2 = adj_dblock_id % 128;
-        pos = (start_pos_dblock + data_block_idx1) * KTFS_BLKSZ;
-        pos += dindirect_offset2 * KTFS_DATA_BLOCK_PTR_SIZE;
-        cache_readat(cache, pos, &data_block_idx2, KTFS_DATA_BLOCK_PTR_SIZE);
+        ptrs = ktfs_map_get(ip, KTFS_MAP_DIND,
+            inode->dindirect[dindirect_instance]);
+        data_block_idx1 = ptrs[adj_dblock_id / 128];
 
-        pos = (start_pos_dblock + data_block_idx2) * KTFS_BLKSZ + dblock_offset;
-        cache_readat(cache, pos, buf, len);
+        ptrs = ktfs_map_get(ip, KTFS_MAP_LEAF, data_block_idx1);
 
-        return 0;
+        return (start_pos_dblock + ptrs[adj_dblock_id % 128]) * KTFS_BLKSZ;
     }
 }
 
-int write_data_blockat (
-        struct ktfs_inode * inode,
-        uint32_t dblock_id,
-        uint32_t dblock_offset,
-        const void * buf,
-        long len)
+// Helper function for readat and writeat. It maps the file range starting at
+// _pos_ to device ranges, merging file blocks that are adjacent on disk, and
+// copies them out of (or with _write_, into) the cache in batches of
+// KTFS_IOV_MAX ranges. Stops after the first batch the cache cuts short and
+// returns the number of bytes copied, or a negative error if none were.
+
+long ktfs_transfer (
+        struct ktfs_icore * ip,
+        unsigned long long pos,
+        void * buf,
+        long len,
+        int write)
 {
-    uint64_t pos;
-    uint64_t start_pos_dblock;
-    uint32_t adj_dblock_id;
+    struct cache_iov iov[KTFS_IOV_MAX];
+    uint64_t dpos;
+    uint32_t blkno;
+    uint32_t blkoff;
+    uint64_t remaining;
+    uint64_t cpycnt;
+    uint64_t iovlen;
+    long result;
+    long done;
+    int iovcnt;
 
-    uint32_t data_block_idx1;
-    uint32_t data_block_idx2;
-    uint32_t dindirect_instance;
+    blkno = pos / KTFS_BLKSZ;
+    blkoff = pos % KTFS_BLKSZ;
+    remaining = len;
+    iovcnt = 0;
+    iovlen = 0;
+    done = 0;
 
-    uint32_t dindirect_offset1;
-    uint32_t dindirect_offset2;
+    while (remaining != 0)
+    {
+        cpycnt = KTFS_BLKSZ - blkoff;
 
-    start_pos_dblock = 1 + fs->superblock.bitmap_block_count;
-    start_pos_dblock += fs->superblock.inode_block_count;
+        if (cpycnt > remaining)
+        {
+            cpycnt = remaining;
+        }
 
-    if (dblock_id < 3)
-    {
-        pos = (start_pos_dblock + inode->block[dblock_id]) * KTFS_BLKSZ;
-        pos += dblock_offset;
-        cache_writeat(cache, pos, buf, len);
-        return 0;
-    }
-    else if ((dblock_id - 3) < 128)
-    {
-        pos = (start_pos_dblock + inode->indirect) * KTFS_BLKSZ;
-        pos += (dblock_id - 3) * KTFS_DATA_BLOCK_PTR_SIZE;
-        cache_readat(cache, pos, &data_block_idx1, KTFS_DATA_BLOCK_PTR_SIZE);
+        dpos = ktfs_bmap(ip, blkno) + blkoff;
 
-        pos = (start_pos_dblock + data_block_idx1) * KTFS_BLKSZ + dblock_offset;
-        cache_writeat(cache, pos, buf, len);
-        return 0;
-    }
-    else
-    {
-        if ((dblock_id - 131) < (128 * 128))
+        if (iovcnt != 0 &&
+            iov[iovcnt - 1].pos + iov[iovcnt - 1].len == dpos)
         {
-            dindirect_instance = 0;
-            adj_dblock_id = dblock_id - 131;
+            iov[iovcnt - 1].len += cpycnt;
         }
         else
         {
-            dindirect_instance = 1;
-            adj_dblock_id = dblock_id - 131 - 128 * 128;
+            if (iovcnt == KTFS_IOV_MAX)
+            {
+                result = write ? cache_writev(cache, iov, iovcnt)
+                    : cache_readv(cache, iov, iovcnt);
+
+                if (result < 0)
+                {
+                    return (done != 0) ? done : result;
+                }
+
+                done += result;
+
+                if (result < iovlen)
+                {
+                    return done;
+                }
+
+                iovcnt = 0;
+                iovlen = 0;
+            }
+
+            iov[iovcnt].pos = dpos;
+            iov[iovcnt].buf = buf;
+            iov[iovcnt].len = cpycnt;
+            iovcnt++;
         }
 
-        dindirect_offset1 = adj_dblock_id / 128;
-        pos = (start_pos_dblock + inode->dindirect[dindirect_instance]) * KTFS_BLKSZ;
-        pos += dindirect_offset1 * KTFS_DATA_BLOCK_PTR_SIZE;
-        cache_readat(cache, pos, &data_block_idx1, KTFS_DATA_BLOCK_PTR_SIZE);
+        iovlen += cpycnt;
+        buf += cpycnt;
+        remaining -= cpycnt;
+        blkoff = 0;
 
-        dindirect_offset2 = adj_dblock_id % 128;
-        pos = (start_pos_dblock + data_block_idx1) * KTFS_BLKSZ;
-        pos += dindirect_offset2 * KTFS_DATA_BLOCK_PTR_SIZE;
-        cache_readat(cache, pos, &data_block_idx2, KTFS_DATA_BLOCK_PTR_SIZE);
+        blkno++;
+    }
 
-        pos = (start_pos_dblock + data_block_idx2) * KTFS_BLKSZ + dblock_offset;
-        cache_writeat(cache, pos, buf, len);
+    result = write ? cache_writev(cache, iov, iovcnt)
+        : cache_readv(cache, iov, iovcnt);
 
-        return 0;
+    if (result < 0)
+    {
+        return (done != 0) ? done : result;
     }
+
+    return done + result;
 }
 
-int allocate_new_data_block(struct ktfs_inode * inode, uint32_t dblock_id)
+// Helper function for open and create. It takes a provided data block id and
+// a offset and reads the data block up to len. The range must not cross the
+// end of the data block.
+
+int read_data_blockat (
+        struct ktfs_icore * ip,
+        uint32_t dblock_id,
+        uint32_t dblock_offset,
+        void * buf,
+        long len)
 {
-    uint32_t pos;
-    uint32_t start_pos_dblock;
+    uint64_t pos;
+
+    pos = ktfs_bmap(ip, dblock_id) + dblock_offset;
+    cache_readat(cache, pos, buf, len);
+
+    return 0;
+}
+
+int write_data_blockat (
+        struct ktfs_icore * ip,
+        uint32_t dblock_id,
+        uint32_t dblock_offset,
+        const void * buf,
+        long len)
+{
+    uint64_t pos;
+
+    pos = ktfs_bmap(ip, dblock_id) + dblock_offset;
+    cache_writeat(cache, pos, buf, len);
+
+    return 0;
+}
+
+// Makes block _new_dblock_id_ data block _dblock_id_ of _inode_, allocating
+// the indirect blocks needed to point at it. The caller allocates the data
+// block itself and still owns it if this fails.
+
+int allocate_new_data_block (
+        struct ktfs_icore * ip, uint32_t dblock_id, uint32_t new_dblock_id)
+{
+    struct ktfs_inode * inode = &ip->dinode;
     uint32_t adj_dblock_id;
 
     uint32_t data_block_idx1;
@@ -587,16 +1310,6 @@ int allocate_new_data_block(struct ktfs_inode * inode, uint32_t dblock_id)
     uint32_t temp;
     uint32_t dindirect_offset1;
     uint32_t dindirect_offset2;
-    uint32_t new_dblock_id = ktfs_get_new_block();
-
-    start_pos_dblock = 1 + fs->superblock.bitmap_block_count;
-    start_pos_dblock += fs->superblock.inode_block_count;
-    new_dblock_id = ktfs_get_new_block();
-
-    if (new_dblock_id == 0)
-    {
-        return -ENODATABLKS;
-    }
 
     if (dblock_id < 3)
     {
@@ -607,18 +1320,17 @@ int allocate_new_data_block(struct ktfs_inode * inode, uint32_t dblock_id)
     {
         if (dblock_id == 3)
         {
-            temp = ktfs_get_new_block();
-            if (temp == 0)
+            if (ktfs_get_new_block(&temp) < 0)
             {
                 return -ENODATABLKS;
             }
 
             inode->indirect = temp;
+            ktfs_map_init(ip, KTFS_MAP_IND, temp);
         }
 
-        pos = (start_pos_dblock + inode->indirect) * KTFS_BLKSZ;
-        pos += (dblock_id - 3) * KTFS_DATA_BLOCK_PTR_SIZE;
-        cache_writeat(cache, pos, &new_dblock_id, KTFS_DATA_BLOCK_PTR_SIZE);
+        ktfs_map_set(ip, KTFS_MAP_IND, inode->indirect, dblock_id - 3,
+            new_dblock_id);
 
         return 0;
     }
@@ -642,37 +1354,44 @@ int allocate_new_data_block(struct ktfs_inode * inode, uint32_t dblock_id)
 
         if (adj_dblock_id == 0)
         {
-            temp = ktfs_get_new_block();
-            if(temp == 0)
+            if (ktfs_get_new_block(&temp) < 0)
             {
                 return -ENODATABLKS;
             }
 
             inode->dindirect[dindirect_instance] = temp;
+            ktfs_map_init(ip, KTFS_MAP_DIND, temp);
         }
 
-        pos = (start_pos_dblock + inode->dindirect[dindirect_instance]) * KTFS_BLKSZ;
-        pos += dindirect_offset1 * KTFS_DATA_BLOCK_PTR_SIZE;
-
         if (dindirect_offset2 == 0)
         {
-            temp = ktfs_get_new_block();
-            if (temp == 0)
+            if (ktfs_get_new_block(&temp) < 0)
             {
+                // the top block was only just allocated for this one
+
+                if (adj_dblock_id == 0)
+                {
+                    ktfs_map_drop(ip, inode->dindirect[dindirect_instance]);
+                    ktfs_release_block(inode->dindirect[dindirect_instance]);
+                }
+
                 return -ENODATABLKS;
             }
 
             data_block_idx1 = temp;
-            cache_writeat(cache, pos, &data_block_idx1, KTFS_DATA_BLOCK_PTR_SIZE);
+            ktfs_map_init(ip, KTFS_MAP_LEAF, data_block_idx1);
+            ktfs_map_set(ip, KTFS_MAP_DIND,
+                inode->dindirect[dindirect_instance], dindirect_offset1,
+                data_block_idx1);
         }
         else
         {
-            cache_readat(cache, pos, &data_block_idx1, KTFS_DATA_BLOCK_PTR_SIZE);
+            data_block_idx1 = ktfs_map_get(ip, KTFS_MAP_DIND,
+                inode->dindirect[dindirect_instance])[dindirect_offset1];
         }
 
-        pos = (start_pos_dblock + data_block_idx1) * KTFS_BLKSZ;
-        pos += dindirect_offset2 * KTFS_DATA_BLOCK_PTR_SIZE;
-        cache_writeat(cache, pos, &new_dblock_id, KTFS_DATA_BLOCK_PTR_SIZE);
+        ktfs_map_set(ip, KTFS_MAP_LEAF, data_block_idx1, dindirect_offset2,
+            new_dblock_id);
 
         return 0;
     }
@@ -689,61 +1408,25 @@ int ktfs_open(const char * name, struct io ** ioptr)
 
     };
 
-    struct ktfs_file * my_file = kcalloc(1, sizeof(struct ktfs_file));
-    struct ktfs_inode root_inode;
-    uint64_t  pos;
-
-    uint32_t num_inodes;
-    uint32_t root_dir_inode_blk_cnt;
-    uint32_t inode_count;
+    struct ktfs_file * my_file;
+    uint32_t slot;
 
-    pos = fs->superblock.root_directory_inode * KTFS_INOSZ;
-    pos += (1 + fs->superblock.bitmap_block_count) * KTFS_BLKSZ;
-    cache_readat(cache, pos, &root_inode, KTFS_INOSZ);
+    slot = ktfs_dir_lookup(name);
 
-    root_dir_inode_blk_cnt = root_inode.size / KTFS_BLKSZ;
-    if(root_inode.size % KTFS_BLKSZ != 0)
+    if (slot == KTFS_DIR_NIL)
     {
-        root_dir_inode_blk_cnt++;
+        return -ENOENT;
     }
 
-    num_inodes = root_inode.size / KTFS_DENSZ;
-    inode_count = 0;
-
-    for (int i = 0; i < root_dir_inode_blk_cnt; i++)
-    {
-        for (int j = 0; j < (KTFS_BLKSZ / KTFS_DENSZ); j++)
-        {
-            read_data_blockat(
-                &root_inode, i, j * KTFS_DENSZ, &my_file->entry, KTFS_DENSZ);
-
-            inode_count++;
-
-            if (strncmp(my_file->entry.name, name, KTFS_MAX_FILENAME_LEN + sizeof(uint8_t)) == 0)
-            {
-                struct ktfs_inode my_inode;
-
-                pos = my_file->entry.inode * KTFS_INOSZ;
-                pos += (1 + fs->superblock.bitmap_block_count) * KTFS_BLKSZ;
-                cache_readat(cache, pos, &my_inode, KTFS_INOSZ);
-
-                my_file->file_size = my_inode.size;
-
-                insert_file_to_list(my_file);
-				*ioptr = create_seekable_io(ioinit1(&my_file->io, &ktfs_intf));
-
-                return 0;
-            }
+    my_file = kcalloc(1, sizeof(struct ktfs_file));
+    my_file->entry = fs->dir[slot];
+    my_file->ip = ktfs_iget(my_file->entry.inode);
+    my_file->in_use = KTFS_FILE_IN_USE;
 
-            // check if read past the last inode
-            if (inode_count == num_inodes)
-            {
-                return -ENOENT; // it cooked
-            }
-        }
-    }
+    insert_file_to_list(my_file);
+    *ioptr = create_seekable_io(ioinit1(&my_file->io, &ktfs_intf));
 
-    return -ENOENT;
+    return 0;
 }
 
 void ktfs_close(struct io* io)
@@ -751,7 +1434,15 @@ void ktfs_close(struct io* io)
     struct ktfs_file * my_file;
 
     my_file = (void*)io - offsetof(struct ktfs_file, io);
-    delete_file_from_list(my_file->entry.name);
+
+    // a file that was deleted while open is already off the list
+
+    if (my_file->in_use == KTFS_FILE_IN_USE)
+    {
+        remove_file_from_list(my_file);
+    }
+
+    kfree(my_file);
     ktfs_flush();
     return;
 }
@@ -759,71 +1450,31 @@ void ktfs_close(struct io* io)
 long ktfs_readat(struct io* io, unsigned long long pos, void * buf, long len)
 {
     struct ktfs_file * my_file = (void*)io - offsetof(struct ktfs_file, io);
-    struct ktfs_inode my_inode;
-    uint64_t inode_pos;
-
-    char blkbuf[KTFS_BLKSZ]; // FIXME: this seems bad
-    uint32_t blkno;
-    uint32_t blkoff;
-    uint64_t remaining;
-    uint64_t cpycnt;
+    struct ktfs_icore * ip;
+    struct ktfs_inode * my_inode;
 
-    inode_pos = my_file->entry.inode * KTFS_INOSZ;
-    inode_pos += (1 + fs->superblock.bitmap_block_count) * KTFS_BLKSZ;
-    cache_readat(cache, inode_pos, &my_inode, KTFS_INOSZ);
     debug("position=%d\n, len=%d", pos, len);
 
-    if (pos >= my_file->file_size || len < 0)
-    {
-        return -EINVAL; //cooked
-    }
-
-    // truncate the write if len is too big
-    if ((pos + len) > my_file->file_size)
+    if (my_file->in_use != KTFS_FILE_IN_USE)
     {
-        len = my_file->file_size - pos;
+        return -ENOENT; // deleted while open
     }
 
-    blkno = pos / KTFS_BLKSZ;
-    blkoff = pos % KTFS_BLKSZ;
+    ip = my_file->ip;
+    my_inode = &ip->dinode;
 
-    remaining = len;
-    cpycnt = KTFS_BLKSZ - blkoff;
-    if (cpycnt > len)
+    if (pos >= my_inode->size || len < 0)
     {
-        cpycnt = len;
+        return -EINVAL; //cooked
     }
 
-    read_data_blockat(&my_inode, blkno, 0, blkbuf, KTFS_BLKSZ);
-    memcpy(buf, blkbuf + blkoff, cpycnt);
-    remaining -= cpycnt;
-	buf += cpycnt;
-
-    blkno++;
-
-    // if data is stored in more than one block
-
-    while (remaining != 0)
+    // truncate the write if len is too big
+    if ((pos + len) > my_inode->size)
     {
-        read_data_blockat(&my_inode, blkno, 0, blkbuf, KTFS_BLKSZ);
-
-        if (remaining > KTFS_BLKSZ)
-        {
-            cpycnt = KTFS_BLKSZ;
-        }
-        else
-        {
-            cpycnt = remaining;
-        }
-
-        memcpy(buf, blkbuf, cpycnt);
-		buf += cpycnt;
-        remaining -= cpycnt;
-
-        blkno++;
+        len = my_inode->size - pos;
     }
 
-    return len;
+    return ktfs_transfer(ip, pos, buf, len, 0);
 }
 
 long ktfs_writeat (
@@ -833,92 +1484,39 @@ long ktfs_writeat (
         long len)
 {
     struct ktfs_file * my_file = (void*)io - offsetof(struct ktfs_file, io);
-    struct ktfs_inode my_inode;
-    uint64_t inode_pos;
+    struct ktfs_icore * ip;
+    struct ktfs_inode * my_inode;
 
-    uint32_t blkno;
-    uint32_t blkoff;
-    uint64_t remaining;
-    uint64_t cpycnt;
-
-    inode_pos = my_file->entry.inode * KTFS_INOSZ;
-    inode_pos += (1 + fs->superblock.bitmap_block_count) * KTFS_BLKSZ;
-    cache_readat(cache, inode_pos, &my_inode, KTFS_INOSZ);
     debug("position: %d\nlen: %d\n", pos, len);
 
-    if (pos >= my_file->file_size || len < 0)
-    {
-        return -EINVAL; //cooked
-    }
-
-    // truncate the write if len is too big
-    if ((pos + len) > my_file->file_size)
+    if (my_file->in_use != KTFS_FILE_IN_USE)
     {
-        len = my_file->file_size - pos;
+        return -ENOENT; // deleted while open
     }
 
-    blkno = pos / KTFS_BLKSZ;
-    blkoff = pos % KTFS_BLKSZ;
-
-    remaining = len;
-    cpycnt = KTFS_BLKSZ - blkoff;
+    ip = my_file->ip;
+    my_inode = &ip->dinode;
 
-    if (cpycnt > len)
+    if (pos >= my_inode->size || len < 0)
     {
-        cpycnt = len;
+        return -EINVAL; //cooked
     }
 
-    write_data_blockat(&my_inode, blkno, blkoff, buf, cpycnt);
-
-    remaining -= cpycnt;
-	buf += cpycnt;
-
-    blkno++;
-
-    // if data is stored in more than one block
-
-    while (remaining != 0)
+    // truncate the write if len is too big
+    if ((pos + len) > my_inode->size)
     {
-        if (remaining > KTFS_BLKSZ)
-        {
-            cpycnt = KTFS_BLKSZ;
-        }
-        else
-        {
-            cpycnt = remaining;
-        }
-
-        write_data_blockat(&my_inode, blkno, 0, buf, cpycnt);
-
-		buf += cpycnt;
-        remaining -= cpycnt;
-
-        blkno++;
+        len = my_inode->size - pos;
     }
 
-    return len;
+    return ktfs_transfer(ip, pos, (void *)buf, len, 1);
 }
 
 
 int ktfs_create(const char *name)
 {
-    struct ktfs_inode root_inode;
+    struct ktfs_icore * root = fs->root;
     struct ktfs_inode new_inode;
-    struct ktfs_dir_entry temp_dentry;
     uint64_t pos;
-    uint32_t root_dir_inode_blk_cnt;
-    uint32_t dentry_cnt;
-
-    pos = fs->superblock.root_directory_inode * KTFS_INOSZ;
-    pos += (1 + fs->superblock.bitmap_block_count) * KTFS_BLKSZ;
-    cache_readat(cache, pos, &root_inode, KTFS_INOSZ);
-
-    root_dir_inode_blk_cnt = root_inode.size / KTFS_BLKSZ;
-
-    if (root_inode.size % KTFS_BLKSZ != 0)
-    {
-        root_dir_inode_blk_cnt++;
-    }
 
     if (strlen(name) > KTFS_MAX_FILENAME_LEN)
     {
@@ -926,39 +1524,32 @@ int ktfs_create(const char *name)
     }
 
     // check if there is already an existing file
-    for (int i = 0; i < root_dir_inode_blk_cnt; i++)
+    if (ktfs_dir_lookup(name) != KTFS_DIR_NIL)
     {
-        for (int j = 0; j < (KTFS_BLKSZ / KTFS_DENSZ); j++)
-        {
-            if (dentry_cnt == (root_inode.size / KTFS_DENSZ))
-            {
-                goto create_continue;
-            }
-
-            read_data_blockat(&root_inode, i, j * KTFS_DENSZ, &temp_dentry, KTFS_DENSZ);
-            if (strncmp(temp_dentry.name, name,
-                KTFS_MAX_FILENAME_LEN + sizeof(uint8_t)) == 0)
-            {
-                return -EINVAL;
-            }
-
-            dentry_cnt++;
-        }
+        return -EINVAL;
     }
 
-create_continue:
-    uint32_t blkoff = root_inode.size % KTFS_BLKSZ;
-    uint32_t blkno = root_inode.size / KTFS_BLKSZ;
+    uint32_t blkoff = root->dinode.size % KTFS_BLKSZ;
+    uint32_t blkno = root->dinode.size / KTFS_BLKSZ;
 
     // block offset is 0 we need a new block
     if (blkoff == 0)
     {
-        if (allocate_new_data_block(&root_inode, blkno) < 0)
+        uint32_t new_dblock_id;
+
+        if (ktfs_get_new_block(&new_dblock_id) < 0)
+        {
+            return -ENODATABLKS;
+        }
+
+        if (allocate_new_data_block(root, blkno, new_dblock_id) < 0)
         {
+            ktfs_release_block(new_dblock_id);
             return -ENODATABLKS;
         }
 
-        cache_writeat(cache, pos, &root_inode, KTFS_INOSZ);
+        root->dirty = 1;
+        ktfs_iupdate(root);
     }
 
     struct ktfs_dir_entry dentry;
@@ -971,11 +1562,13 @@ create_continue:
 
     dentry.inode = new_inode_num;
     memcpy(dentry.name, name, KTFS_MAX_FILENAME_LEN + sizeof(uint8_t));
-    write_data_blockat(&root_inode, blkno, blkoff, &dentry, KTFS_DENSZ);
-    root_inode.size += KTFS_DENSZ;
+    write_data_blockat(root, blkno, blkoff, &dentry, KTFS_DENSZ);
+    root->dinode.size += KTFS_DENSZ;
+    ktfs_dir_insert(&dentry);
 
     // update root inode
-    cache_writeat(cache, pos, &root_inode, KTFS_INOSZ);
+    root->dirty = 1;
+    ktfs_iupdate(root);
 
     // set initilze file size to 0
     new_inode.size = 0;
@@ -994,31 +1587,34 @@ create_continue:
 
 int ktfs_ext_len(struct ktfs_file * my_file, void * arg)
 {
-    struct ktfs_inode my_inode;
-    uint64_t inode_pos;
+    struct ktfs_icore * ip = my_file->ip;
 
     uint64_t len;
     uint32_t start_dblock_id;
     uint32_t last_dblock_id;
+    uint32_t start_pos_dblock;
+    uint32_t goal;
+    uint32_t first;
+    uint32_t next;
+    int cnt;
     size_t old_size;
+    uint64_t dpos;
+    uint64_t zero_pos;
+    uint64_t zero_len;
 
     len = *(uint64_t *) arg;
 
     // TODO: max file size
-    if (len <= my_file->file_size || len == 0)
+    if (len <= ip->dinode.size || len == 0)
     {
         return 0;
     }
 
-    old_size = my_file->file_size;
-    my_file->file_size = len;
-
-    inode_pos = my_file->entry.inode * KTFS_INOSZ;
-    inode_pos += (1 + fs->superblock.bitmap_block_count) * KTFS_BLKSZ;
-    cache_readat(cache, inode_pos, &my_inode, KTFS_INOSZ);
+    // the new size is only set once the blocks are in place, so a failure
+    // leaves the file as it was
 
-    my_inode.size = len;
-    cache_writeat(cache, inode_pos, &my_inode, KTFS_INOSZ);
+    old_size = ip->dinode.size;
+    ip->dirty = 1;
 
     last_dblock_id = (len - 1) / KTFS_BLKSZ;
 
@@ -1032,43 +1628,149 @@ int ktfs_ext_len(struct ktfs_file * my_file, void * arg)
         start_dblock_id = (old_size - 1) / KTFS_BLKSZ + 1;
     }
 
-    for (int i = start_dblock_id; i <= last_dblock_id; i++ )
+    // take the new blocks as a few long runs, each one continuing the file
+    // where it ends on disk if possible, so that the file can be read
+    // sequentially
+
+    start_pos_dblock = 1 + fs->superblock.bitmap_block_count;
+    start_pos_dblock += fs->superblock.inode_block_count;
+
+    for (next = start_dblock_id; next <= last_dblock_id; )
     {
-        if (allocate_new_data_block(&my_inode, i) < 0)
+        if (next == 0)
         {
+            goal = UINT32_MAX; // no block to follow
+        }
+        else
+        {
+            goal = ktfs_bmap(ip, next - 1) / KTFS_BLKSZ;
+            goal = goal - start_pos_dblock + 1;
+        }
+
+        cnt = ktfs_alloc_run(goal, last_dblock_id - next + 1, &first);
+
+        if (cnt < 0)
+        {
+            ktfs_ext_undo(ip, start_dblock_id, next);
             return -ENODATABLKS;
         }
 
-        cache_writeat(cache, inode_pos, &my_inode, KTFS_INOSZ);
+        for (int n = 0; n < cnt; n++, next++)
+        {
+            if (allocate_new_data_block(ip, next, first + n) < 0)
+            {
+                // give back the part of the run that was not used
+
+                while (n < cnt)
+                {
+                    ktfs_release_block(first + n++);
+                }
+
+                ktfs_ext_undo(ip, start_dblock_id, next);
+                return -ENODATABLKS;
+            }
+        }
+    }
+
+    // the new blocks still hold whatever was there before, so zero them,
+    // merging blocks that are adjacent on disk
+
+    zero_pos = 0;
+    zero_len = 0;
+
+    for (int i = start_dblock_id; i <= last_dblock_id; i++)
+    {
+        dpos = ktfs_bmap(ip, i);
+
+        if (zero_len != 0 && zero_pos + zero_len == dpos)
+        {
+            zero_len += KTFS_BLKSZ;
+            continue;
+        }
+
+        if (zero_len != 0 && ktfs_zero_range(zero_pos, zero_len) < 0)
+        {
+            ktfs_ext_undo(ip, start_dblock_id, last_dblock_id + 1);
+            return -EIO;
+        }
+
+        zero_pos = dpos;
+        zero_len = KTFS_BLKSZ;
+    }
+
+    if (zero_len != 0 && ktfs_zero_range(zero_pos, zero_len) < 0)
+    {
+        ktfs_ext_undo(ip, start_dblock_id, last_dblock_id + 1);
+        return -EIO;
     }
 
+    ip->dinode.size = len;
+
     return 0;
 }
 
+// Releases data blocks _start_ through _end_ - 1 of _ip_, which a failed
+// ktfs_ext_len() allocated, last block first so that the pointer blocks go
+// with the first block they map.
 
-int ktfs_delete(const char * name)
+void ktfs_ext_undo(struct ktfs_icore * ip, uint32_t start, uint32_t end)
 {
-    struct ktfs_inode root_inode;
-    struct ktfs_inode my_inode;
-    struct ktfs_dir_entry temp_dentry;
-    struct ktfs_dir_entry last_dentry;
+    while (end > start)
+    {
+        release_data_block(ip, --end);
+    }
+}
 
-    int dentry_cnt = 0;
-    uint32_t root_dir_inode_blk_cnt;
 
-    uint64_t pos;
+// Fills in _stats_ with how the data blocks of the file are laid out on disk.
 
-    pos = fs->superblock.root_directory_inode * KTFS_INOSZ;
-    pos += (1 + fs->superblock.bitmap_block_count) * KTFS_BLKSZ;
-    cache_readat(cache, pos, &root_inode, KTFS_INOSZ);
+void ktfs_frag_stats(struct ktfs_icore * ip, struct ktfs_frag_stats * stats)
+{
+    uint32_t nblocks;
+    uint32_t run;
+    uint64_t dpos;
+    uint64_t prev;
 
-    root_dir_inode_blk_cnt = root_inode.size / KTFS_BLKSZ;
+    memset(stats, 0, sizeof(struct ktfs_frag_stats));
+    nblocks = (ip->dinode.size + KTFS_BLKSZ - 1) / KTFS_BLKSZ;
 
-    if (root_inode.size % KTFS_BLKSZ != 0)
+    prev = 0;
+    run = 0;
+
+    for (uint32_t i = 0; i < nblocks; i++)
     {
-        root_dir_inode_blk_cnt++;
+        dpos = ktfs_bmap(ip, i);
+
+        if (i != 0 && dpos == prev + KTFS_BLKSZ)
+        {
+            run++;
+        }
+        else
+        {
+            stats->extents++;
+            run = 1;
+        }
+
+        if (run > stats->longest)
+        {
+            stats->longest = run;
+        }
+
+        prev = dpos;
     }
 
+    stats->blocks = nblocks;
+}
+
+int ktfs_delete(const char * name)
+{
+    struct ktfs_icore * root = fs->root;
+    struct ktfs_icore * ip;
+    struct ktfs_dir_entry temp_dentry;
+    struct ktfs_dir_entry last_dentry;
+
+    uint32_t dentry_cnt;
+
     // check if file name is valid
     if (strlen(name) > KTFS_MAX_FILENAME_LEN)
     {
@@ -1076,79 +1778,65 @@ int ktfs_delete(const char * name)
     }
 
     // check if a file exists
-    for (int i = 0; i < root_dir_inode_blk_cnt; i++)
-    {
-        for (int j = 0; j < (KTFS_BLKSZ / KTFS_DENSZ); j++)
-        {
-            if (dentry_cnt == (root_inode.size / KTFS_DENSZ))
-            {
-                return -ENOENT;
-            }
-
-            read_data_blockat(&root_inode, i, j * KTFS_DENSZ, &temp_dentry, KTFS_DENSZ);
-            if (strncmp(temp_dentry.name, name, KTFS_MAX_FILENAME_LEN + sizeof(uint8_t)) == 0)
-            {
-                goto found_name;
-            }
+    dentry_cnt = ktfs_dir_lookup(name);
 
-            dentry_cnt++;
-        }
+    if (dentry_cnt == KTFS_DIR_NIL)
+    {
+        return -ENOENT; //file not found
     }
 
-    // file not found
-    return -ENOENT; //file not found
+    temp_dentry = fs->dir[dentry_cnt];
 
-found_name:
-
-    uint64_t inode_pos;
     uint32_t data_block_count;
 
-    inode_pos = temp_dentry.inode * KTFS_INOSZ;
-    inode_pos += (1 + fs->superblock.bitmap_block_count) * KTFS_BLKSZ;
-    cache_readat(cache, inode_pos, &my_inode, KTFS_INOSZ);
+    // an open of the file may hold a newer copy of the inode than the cache
+    ip = ktfs_iget(temp_dentry.inode);
 
-    data_block_count = my_inode.size / KTFS_BLKSZ;
+    data_block_count = ip->dinode.size / KTFS_BLKSZ;
 
-    if (my_inode.size % KTFS_BLKSZ != 0)
+    if (ip->dinode.size % KTFS_BLKSZ != 0)
     {
         data_block_count++;
     }
 
     for (int i = data_block_count - 1; i >= 0; i--)
     {
-        release_data_block(&my_inode, i);
+        release_data_block(ip, i);
     }
 
+    // the inode is being freed, there is nothing to write back
+    ip->dirty = 0;
+
     ktfs_release_inode(temp_dentry.inode);
 
     // get the block info of the last dentry
 
-    uint32_t last_blkoff = (root_inode.size - KTFS_DENSZ) % KTFS_BLKSZ;
-    uint32_t last_blkno = (root_inode.size - KTFS_DENSZ) / KTFS_BLKSZ;
+    uint32_t last_blkoff = (root->dinode.size - KTFS_DENSZ) % KTFS_BLKSZ;
+    uint32_t last_blkno = (root->dinode.size - KTFS_DENSZ) / KTFS_BLKSZ;
 
     uint32_t curr_blkoff = (dentry_cnt * KTFS_DENSZ) % KTFS_BLKSZ;
     uint32_t curr_blkno = (dentry_cnt * KTFS_DENSZ) / KTFS_BLKSZ;
 
-    read_data_blockat(&root_inode, last_blkno, last_blkoff, &last_dentry, KTFS_DENSZ);
-    write_data_blockat(&root_inode, curr_blkno, curr_blkoff, &last_dentry, KTFS_DENSZ);
+    last_dentry = fs->dir[fs->dir_cnt - 1];
+    write_data_blockat(root, curr_blkno, curr_blkoff, &last_dentry, KTFS_DENSZ);
+    ktfs_dir_remove(dentry_cnt);
 
     // release the dentry block if it is the last entry left in the block
     if (last_blkoff == 0)
     {
-        release_data_block(&root_inode, last_blkno);
+        release_data_block(root, last_blkno);
     }
 
     // decrease the size of filesystem
-    root_inode.size -= KTFS_DENSZ;
-
-    pos = fs->superblock.root_directory_inode * KTFS_INOSZ;
-    pos += (1 + fs->superblock.bitmap_block_count) * KTFS_BLKSZ; // trust issues
-
-    cache_writeat(cache, pos, &root_inode, KTFS_INOSZ);
+    root->dinode.size -= KTFS_DENSZ;
+    root->dirty = 1;
+    ktfs_iupdate(root);
 
     // TODO: need to create a table of file names and their ioptr for
     // the close function
     delete_file_from_list(name);
+    ktfs_iput(ip);
+    ktfs_discard_flush();
     ktfs_flush();
 
     return 0;
@@ -1160,6 +1848,11 @@ int ktfs_cntl(struct io *io, int cmd, void *arg)
 	size_t * szarg = arg;
     int result;
 
+    if (my_file->in_use != KTFS_FILE_IN_USE)
+    {
+        return -ENOENT; // deleted while open
+    }
+
     switch (cmd)
     {
     case IOCTL_GETBLKSZ:
@@ -1169,11 +1862,22 @@ int ktfs_cntl(struct io *io, int cmd, void *arg)
         return ktfs_ext_len(my_file, arg);
         break;
     case IOCTL_GETEND:
-		*szarg = my_file->file_size;
+		*szarg = my_file->ip->dinode.size;
 		result = 0;
         break;
+    case IOCTL_GETFRAGSTATS:
+        ktfs_frag_stats(my_file->ip, arg);
+        result = 0;
+        break;
+    case IOCTL_GETCACHESZ:
+    case IOCTL_GETCACHEPOLICY:
+    case IOCTL_GETCACHESTATS:
+        // a file may look at the block cache, but resizing it or changing
+        // its policy is left to the kernel
+        result = cache_cntl(cache, cmd, arg);
+        break;
     default:
-        result = -EINVAL;
+        result = -ENOTSUP;
     }
 
     return result;
@@ -1181,6 +1885,15 @@ int ktfs_cntl(struct io *io, int cmd, void *arg)
 
 int ktfs_flush(void)
 {
-    cache_flush(cache);
-    return 0;
+    struct ktfs_icore * ip;
+
+    for (int i = 0; i < KTFS_ITABLE_SIZE; i++)
+    {
+        for (ip = itable[i]; ip != NULL; ip = ip->next)
+        {
+            ktfs_iupdate(ip);
+        }
+    }
+
+    return cache_flush(cache);
 }
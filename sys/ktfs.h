@@ -90,6 +90,16 @@ struct ktfs_data_block {
     uint8_t data[KTFS_BLKSZ];
 }__attribute__((packed));
 
+// Layout of a file's data blocks, returned by the IOCTL_GETFRAGSTATS ioctl on
+// an open file. An extent is a run of blocks that are consecutive on disk, so
+// a file laid out sequentially has a single one.
+
+struct ktfs_frag_stats {
+    uint32_t blocks;    // data blocks of the file
+    uint32_t extents;   // runs of consecutive blocks
+    uint32_t longest;   // blocks in the longest run
+};
+
 struct io; // extern decl.
 struct file_system; // opaque decl.
 
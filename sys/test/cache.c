@@ -61,7 +61,7 @@ void test_cache(){
     }
 
     open_device("vioblk", 0, &blkio);
-    create_cache(blkio, &cache);
+    create_cache(blkio, CACHE_CAPACITY, CACHE_WRITEBACK, &cache);
 
     uint8_t arr[512];
     uint8_t buf[512];
@@ -76,7 +76,7 @@ void test_cache(){
             //kprintf ("\n");
 
 
-        cache_write_at(cache, i*512, arr, 512);
+        cache_writeat(cache, i*512, arr, 512);
     }
 
     cache_flush(cache);
@@ -84,7 +84,7 @@ void test_cache(){
     kprintf ("READ CACHE\n");
     for (uint8_t i = 0; i < num_blocks; i++) {
         //kprintf ("block %d\n", i);
-        cache_read_at(cache, i * 512, buf, 512);
+        cache_readat(cache, i * 512, buf, 512);
         for (int j = 0; j < 512; j++) {
             assert(buf[j] == i);
             //kprintf ("%d ", buf[j]);
@@ -96,14 +96,15 @@ void test_cache(){
     int blkoff = 500;
     len = 8;
 
-    cache_write_at(cache, blkno * 512 + blkoff, buf, len);
+    cache_writeat(cache, blkno * 512 + blkoff, buf, len);
     uint8_t buf2[512];
 
-    cache_read_at(cache, blkno * 512, buf2, 512);
+    cache_readat(cache, blkno * 512, buf2, 512);
     kprintf("\n");
     for (int j = 0; j < 512; j++) {
         kprintf ("%d ", buf2[j]);
     }
     kprintf("\n");
+    cache_dump_stats(cache);
     kprintf ("Cache test passed\n");
 }
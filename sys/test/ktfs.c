@@ -12,6 +12,7 @@
 #include "fs.h"
 #include "string.h"
 #include "memory.h"
+#include "error.h"
 
 #define LOCK_ITER 5
 
@@ -19,6 +20,10 @@ void lock_test_fn(struct lock * test_lock, int iter);
 void test_ktfs();
 void test_open_files();
 void test_open_files2();
+void check_frag_stats(const char * name, struct io * file);
+void test_delete_open();
+
+int ktfs_get_new_block(uint32_t * block_id);
 
 
 extern char _kimg_blob_start[];
@@ -389,7 +394,9 @@ void test_ktfs(){
     kprintf("\n");
 
 
-    kprintf("New Block id:%d \n", ktfs_get_new_block());
+    uint32_t new_block;
+    kprintf("New Block: %d ", ktfs_get_new_block(&new_block));
+    kprintf("id:%d \n", new_block);
 
 
     fscreate("file3");
@@ -494,6 +501,10 @@ void test_ktfs(){
 
     fsflush();
 
+    // files grown with SETEND should each sit in one or a few extents
+    check_frag_stats("lev", my_file2);
+    check_frag_stats("file7", my_file7);
+
     kprintf ("READ KTFS\n");
     for (uint8_t i = 0; i < num_blocks; i++) {
         //kprintf ("block %d\n", i);
@@ -521,12 +532,64 @@ void test_ktfs(){
         kprintf ("%d ", buf2[j]);
     }
     kprintf("\n");
+    test_delete_open();
+
     kprintf ("ktfs test passed\n");
 
 
 
 
 
+}
+
+void test_delete_open(){
+    struct io * file = NULL;
+    unsigned long long new_len = 2048;
+    char c = 'x';
+
+    assert(fscreate("delopen") == 0);
+    assert(fsopen("delopen", &file) == 0);
+    assert(ioctl(file, IOCTL_SETEND, &new_len) == 0);
+    assert(iowriteat(file, 0, &c, 1) == 1);
+
+    // the handle outlives the file, but can no longer be used
+    assert(fsdelete("delopen") == 0);
+    assert(ioreadat(file, 0, &c, 1) == -ENOENT);
+    assert(iowriteat(file, 0, &c, 1) == -ENOENT);
+    assert(fsopen("delopen", &file) == -ENOENT);
+
+    ioclose(file);
+    kprintf("delete of an open file passed\n");
+}
+
+// Checks that a file grown on a freshly formatted image is laid out in
+// sequence. Only a pointer block allocated part way through the file may
+// break it up: the indirect block, the top doubly-indirect block and one
+// block for every 128 pointers under it.
+void check_frag_stats(const char * name, struct io * file){
+    struct ktfs_frag_stats stats;
+    unsigned long long size;
+    uint32_t nblocks;
+    uint32_t nptrblks;
+
+    assert(ioctl(file, IOCTL_GETFRAGSTATS, &stats) == 0);
+    assert(ioctl(file, IOCTL_GETEND, &size) == 0);
+    kprintf("%s: %u blocks in %u extents, longest %u\n",
+        name, stats.blocks, stats.extents, stats.longest);
+
+    nblocks = (size + KTFS_BLKSZ - 1) / KTFS_BLKSZ;
+    assert(stats.blocks == nblocks);
+
+    nptrblks = 0;
+
+    if (nblocks > 3)
+        nptrblks++;
+
+    if (nblocks > 131)
+        nptrblks += 1 + (nblocks - 131 + 127) / 128;
+
+    assert(stats.extents >= 1 && stats.extents <= 1 + nptrblks);
+    assert(stats.longest <= stats.blocks);
 }
 
 void test_open_files(){
@@ -70,6 +70,32 @@ struct io_term {
 #define IOCTL_SETEND    3
 #define IOCTL_GETPOS    4
 #define IOCTL_SETPOS    5
+#define IOCTL_GETCACHESZ 6
+#define IOCTL_GETCACHEPOLICY 8
+#define IOCTL_GETCACHESTATS 10
+#define IOCTL_GETFRAGSTATS 14
+
+// returned by IOCTL_GETCACHESTATS, latencies are in timer ticks
+
+struct cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t fill_waits;
+    uint64_t miss_ticks;
+    uint64_t ra_blocks;
+    uint64_t ra_hits;
+    uint64_t evictions;
+    uint64_t hot_admits;
+    uint64_t writebacks;
+};
+
+// returned by IOCTL_GETFRAGSTATS on a KTFS file
+
+struct ktfs_frag_stats {
+    uint32_t blocks;    // data blocks of the file
+    uint32_t extents;   // runs of blocks that are consecutive on disk
+    uint32_t longest;   // blocks in the longest run
+};
 
 // refcount functions
 unsigned long iorefcnt(const struct io * io);